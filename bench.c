@@ -0,0 +1,612 @@
+/*******************************************************************************
+ * This is a benchmark for the heap manager.  It runs a handful of workloads
+ * against shmHeap and against the C library's malloc(), and reports how long
+ * each operation took.  Unlike main.c, nothing is printed and nothing is
+ * checked while the clock is running, unless you ask for checking with -c.
+ *
+ * Usage: bench [-a shm|libc|both] [-w workload|all] [-n ops] [-s seed] [-q quickLimit]
+ *              [-f policy|all] [-g fitPercent] [-m minSplit] [-c]
+ *
+ * For each allocator and workload it prints the throughput, the 50th, 99th
+ * and 99.9th percentile time per operation, and the worst fragmentation seen
+ * (the fraction of the allocator's footprint that wasn't live data).  The
+ * timings in check mode include the checking, so don't compare them.  -q
+ * sets ShmHeapOptions.quickLimit, so freed chunks are coalesced later.
+ * -f picks the placement policy (good, best, first or next), and "-f all"
+ * runs shmHeap once with each of them so they can be compared side by side.
+ * -g and -m set ShmHeapOptions.fitPercent and ShmHeapOptions.minSplit.
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmHeap.h"
+
+/* The number of live allocations each workload juggles. */
+#define SLOTS (4096)
+
+/* How big the shmHeap is allowed to get.  It starts small and grows as
+ * needed, the way the C library's heap does, so their footprints can be
+ * compared. */
+#define SHM_INITIAL_SIZE (1024 * 1024)
+#define SHM_MAX_SIZE     (1024UL * 1024 * 1024)
+
+/* How often (in operations) to measure fragmentation. */
+#define FRAG_INTERVAL (1024)
+
+/* The producer/consumer queue. */
+#define QUEUE_LEN (1024)
+
+/* This is what an allocator looks like to the workloads. */
+typedef struct allocator {
+	const char *name;
+	int (*init)(void);
+	void (*fini)(void);
+	void *(*alloc)(size_t size);
+	void (*release)(void *ptr);
+	void *(*resize)(void *ptr, size_t size);
+
+	/* The number of bytes the allocator is holding on to. */
+	size_t (*footprint)(void);
+} Allocator;
+
+/* A live allocation. */
+typedef struct slot {
+	unsigned char *ptr;
+	size_t size;
+} Slot;
+
+/* What a workload measured. */
+typedef struct result {
+	uint32_t *ns;
+	size_t ops;
+	double seconds;
+
+	/* The worst fraction of the footprint that wasn't live data, or -1
+	 * if the workload doesn't measure it. */
+	double peakFrag;
+} Result;
+
+static int check = 0;
+static unsigned long seed = 1;
+static size_t liveBytes = 0;
+
+/*******************************************************************************
+ * These are the allocators.
+ ******************************************************************************/
+
+/* The settings the heap is created with. */
+static ShmHeapOptions shmOpts;
+
+static int shmInit(void)
+{
+	return shmHeapCreateWithOptions(NULL, SHM_INITIAL_SIZE, SHM_MAX_SIZE, &shmOpts);
+}
+
+static void shmFini(void)
+{
+	shmHeapDetach();
+}
+
+/* The bytes in the heap's chunks, in use or free.  Like mallinfo2()'s
+ * arena + hblkhd, that's what the heap is holding on to right now. */
+static size_t shmFootprint(void)
+{
+	ShmHeapStats stats;
+
+	shmHeapGetStats(&stats);
+	return stats.inUseBytes + stats.freeBytes;
+}
+
+static int libcInit(void)
+{
+	return 0;
+}
+
+static void libcFini(void)
+{
+	malloc_trim(0);
+}
+
+static size_t libcFootprint(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+	return mi.arena + mi.hblkhd;
+}
+
+/* The placement policies that -f can pick. */
+typedef struct policy {
+	const char *name;
+	unsigned int fitPolicy;
+} Policy;
+
+static const Policy policies[] = {
+	{ "good",  SHM_HEAP_FIT_GOOD  },
+	{ "best",  SHM_HEAP_FIT_BEST  },
+	{ "first", SHM_HEAP_FIT_FIRST },
+	{ "next",  SHM_HEAP_FIT_NEXT  },
+};
+#define POLICY_COUNT (sizeof(policies) / sizeof(policies[0]))
+
+static Allocator allocators[] = {
+	{ "shm",  shmInit,  shmFini,  shmHeapMalloc, shmHeapFree, shmHeapRealloc, shmFootprint },
+	{ "libc", libcInit, libcFini, malloc,        free,        realloc,        libcFootprint },
+};
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+/*******************************************************************************
+ * These are the helpers that the workloads share.
+ ******************************************************************************/
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A small, fast random number generator (xorshift64*), so that the C
+ * library's random() doesn't show up in the timings. */
+static uint64_t nextRandom(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* In check mode, every allocation is filled with a pattern that depends on
+ * "tag", and the pattern is verified before the memory is freed. */
+static void fill(unsigned char *ptr, size_t size, unsigned tag)
+{
+	if(check && ptr) {
+		memset(ptr, (unsigned char) tag, size);
+	}
+}
+
+static void verify(const unsigned char *ptr, size_t size, unsigned tag)
+{
+	size_t i;
+
+	if(!check || ptr == NULL) {
+		return;
+	}
+	for(i = 0; i < size; i++) {
+		if(ptr[i] != (unsigned char) tag) {
+			fprintf(stderr, "Check failed: %p[%zu] is 0x%02x, expected 0x%02x\n",
+			        ptr, i, ptr[i], (unsigned char) tag);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Record one operation that started at "start". */
+static void record(Result *res, uint64_t start)
+{
+	uint64_t ns = nowNs() - start;
+	res->ns[res->ops++] = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t) ns;
+}
+
+static void noteFrag(Result *res, Allocator *a, size_t op, size_t ops)
+{
+	/* Skip the warm up. */
+	if(op % FRAG_INTERVAL || op < ops / 10) {
+		return;
+	}
+
+	size_t footprint = a->footprint();
+	size_t live = __atomic_load_n(&liveBytes, __ATOMIC_RELAXED);
+	double frag = (footprint > live) ? 1.0 - (double) live / footprint : 0.0;
+	if(frag > res->peakFrag) {
+		res->peakFrag = frag;
+	}
+}
+
+static void freeSlots(Allocator *a, Slot *slots, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		if(slots[i].ptr) {
+			verify(slots[i].ptr, slots[i].size, (unsigned) i);
+			a->release(slots[i].ptr);
+			slots[i].ptr = NULL;
+		}
+	}
+	liveBytes = 0;
+}
+
+/* Allocate or free a random slot, "ops" times.  "pickSize" chooses the size
+ * of each new allocation. */
+static void randomSlots(Allocator *a, Result *res, size_t ops, size_t (*pickSize)(uint64_t *))
+{
+	static Slot slots[SLOTS];
+	uint64_t rng = seed;
+	size_t op;
+
+	for(op = 0; op < ops; op++) {
+		unsigned i = nextRandom(&rng) % SLOTS;
+		Slot *s = &slots[i];
+
+		if(s->ptr) {
+			verify(s->ptr, s->size, i);
+			uint64_t start = nowNs();
+			a->release(s->ptr);
+			record(res, start);
+			liveBytes -= s->size;
+			s->ptr = NULL;
+		}
+		else {
+			size_t size = pickSize(&rng);
+			uint64_t start = nowNs();
+			s->ptr = a->alloc(size);
+			record(res, start);
+			if(s->ptr) {
+				s->size = size;
+				liveBytes += size;
+				fill(s->ptr, size, i);
+			}
+		}
+		noteFrag(res, a, op, ops);
+	}
+
+	freeSlots(a, slots, SLOTS);
+}
+
+/*******************************************************************************
+ * These are the workloads.
+ ******************************************************************************/
+
+/* Every size from 1 to 4KB is equally likely. */
+static size_t uniformSize(uint64_t *rng)
+{
+	return 1 + nextRandom(rng) % 4096;
+}
+
+static void workloadUniform(Allocator *a, Result *res, size_t ops)
+{
+	randomSlots(a, res, ops, uniformSize);
+}
+
+/* Most allocations come from a few small size classes, and the rest are
+ * spread out up to 64KB. */
+static size_t skewedSize(uint64_t *rng)
+{
+	static const size_t classes[] = { 16, 24, 32, 48, 64, 128 };
+	uint64_t r = nextRandom(rng);
+
+	if(r % 10 < 8) {
+		return classes[(r >> 8) % (sizeof(classes) / sizeof(classes[0]))];
+	}
+	return 1 + (r >> 8) % (64 * 1024);
+}
+
+static void workloadSkewed(Allocator *a, Result *res, size_t ops)
+{
+	randomSlots(a, res, ops, skewedSize);
+}
+
+/* One thread allocates and another frees, through a queue. */
+typedef struct prodCons {
+	Allocator *a;
+	Result *res;
+	size_t ops;
+	void *queue[QUEUE_LEN];
+	size_t sizes[QUEUE_LEN];
+	size_t head;
+	size_t tail;
+} ProdCons;
+
+static void *consumer(void *arg)
+{
+	ProdCons *pc = arg;
+	size_t n;
+
+	for(n = 0; n < pc->ops; n++) {
+		size_t tail = pc->tail;
+		while(__atomic_load_n(&pc->head, __ATOMIC_ACQUIRE) == tail) {
+			sched_yield();
+		}
+
+		void *ptr = pc->queue[tail % QUEUE_LEN];
+		size_t size = pc->sizes[tail % QUEUE_LEN];
+		verify(ptr, size, (unsigned) tail);
+		pc->a->release(ptr);
+		__atomic_fetch_sub(&liveBytes, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&pc->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void workloadProdCons(Allocator *a, Result *res, size_t ops)
+{
+	static ProdCons pc;
+	pthread_t thread;
+	uint64_t rng = seed;
+	size_t n;
+
+	memset(&pc, 0, sizeof(pc));
+	pc.a = a;
+	pc.res = res;
+	pc.ops = ops;
+	pthread_create(&thread, NULL, consumer, &pc);
+
+	/* Only the allocations are timed; the frees happen on the other
+	 * thread at the same time.  Both threads keep "liveBytes" up to date,
+	 * so the fragmentation is sampled here the same way as in the other
+	 * workloads. */
+	for(n = 0; n < ops; n++) {
+		while(n - __atomic_load_n(&pc.tail, __ATOMIC_ACQUIRE) >= QUEUE_LEN) {
+			sched_yield();
+		}
+
+		size_t size = skewedSize(&rng);
+		uint64_t start = nowNs();
+		void *ptr = a->alloc(size);
+		record(res, start);
+		if(ptr == NULL) {
+			fprintf(stderr, "%s: out of memory\n", a->name);
+			exit(EXIT_FAILURE);
+		}
+		fill(ptr, size, (unsigned) n);
+
+		pc.queue[n % QUEUE_LEN] = ptr;
+		pc.sizes[n % QUEUE_LEN] = size;
+		__atomic_fetch_add(&liveBytes, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&pc.head, n + 1, __ATOMIC_RELEASE);
+
+		noteFrag(res, a, n, ops);
+	}
+
+	pthread_join(thread, NULL);
+}
+
+/* Keep resizing live allocations, growing a little more often than they
+ * shrink. */
+static void workloadRealloc(Allocator *a, Result *res, size_t ops)
+{
+	static Slot slots[SLOTS];
+	uint64_t rng = seed;
+	size_t op;
+
+	for(op = 0; op < ops; op++) {
+		unsigned i = nextRandom(&rng) % SLOTS;
+		Slot *s = &slots[i];
+		size_t size;
+
+		if(s->ptr == NULL || s->size > 256 * 1024) {
+			size = 1 + nextRandom(&rng) % 256;
+		}
+		else if(nextRandom(&rng) % 3) {
+			size = s->size + s->size / 2 + 1;
+		}
+		else {
+			size = s->size / 2 + 1;
+		}
+
+		verify(s->ptr, (s->size < size) ? s->size : size, i);
+		uint64_t start = nowNs();
+		unsigned char *ptr = a->resize(s->ptr, size);
+		record(res, start);
+		if(ptr == NULL) {
+			continue;
+		}
+
+		liveBytes += size - (s->ptr ? s->size : 0);
+		s->ptr = ptr;
+		s->size = size;
+		fill(ptr, size, i);
+		noteFrag(res, a, op, ops);
+	}
+
+	freeSlots(a, slots, SLOTS);
+}
+
+/* Build up a lot of long-lived small allocations with short-lived large ones
+ * in between, then free most of the small ones and ask for large ones again.
+ * This is the workload that fragments the heap. */
+static void workloadFragment(Allocator *a, Result *res, size_t ops)
+{
+	static Slot slots[SLOTS * 4];
+	uint64_t rng = seed;
+	size_t op;
+
+	for(op = 0; op < ops; op++) {
+		unsigned i = nextRandom(&rng) % (SLOTS * 4);
+		Slot *s = &slots[i];
+		int phase = (op * 4 / ops);
+
+		/* Phases 0 and 2 mostly allocate, phases 1 and 3 mostly free. */
+		int allocate = ((phase & 1) == 0) ? (nextRandom(&rng) % 4 != 0) : (nextRandom(&rng) % 4 == 0);
+
+		if(s->ptr && !allocate) {
+			verify(s->ptr, s->size, i);
+			uint64_t start = nowNs();
+			a->release(s->ptr);
+			record(res, start);
+			liveBytes -= s->size;
+			s->ptr = NULL;
+		}
+		else if(s->ptr == NULL && allocate) {
+			size_t size = (i % 16 == 0) ? 16 * 1024 + nextRandom(&rng) % (256 * 1024)
+			                            : 16 + nextRandom(&rng) % 512;
+			uint64_t start = nowNs();
+			s->ptr = a->alloc(size);
+			record(res, start);
+			if(s->ptr) {
+				s->size = size;
+				liveBytes += size;
+				fill(s->ptr, size, i);
+			}
+		}
+		noteFrag(res, a, op, ops);
+	}
+
+	freeSlots(a, slots, SLOTS * 4);
+}
+
+typedef struct workload {
+	const char *name;
+	void (*run)(Allocator *a, Result *res, size_t ops);
+} Workload;
+
+static Workload workloads[] = {
+	{ "uniform",  workloadUniform },
+	{ "skewed",   workloadSkewed },
+	{ "prodcons", workloadProdCons },
+	{ "realloc",  workloadRealloc },
+	{ "fragment", workloadFragment },
+};
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/*******************************************************************************
+ * This is the driver.
+ ******************************************************************************/
+
+static int compareNs(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const Result *res, double p)
+{
+	size_t i = (size_t) (p * (res->ops - 1));
+	return res->ns[i];
+}
+
+static void report(const char *label, const Workload *w, Result *res)
+{
+	if(res->ops == 0) {
+		return;
+	}
+
+	qsort(res->ns, res->ops, sizeof(res->ns[0]), compareNs);
+
+	printf("%-9s %-9s %10zu ops %8.2f Mops/s  p50 %6u ns  p99 %7u ns  p999 %8u ns",
+	       label, w->name, res->ops, res->ops / res->seconds / 1e6,
+	       percentile(res, 0.50), percentile(res, 0.99), percentile(res, 0.999));
+	if(res->peakFrag >= 0.0) {
+		printf("  peak frag %5.1f%%\n", res->peakFrag * 100.0);
+	}
+	else {
+		printf("  peak frag     -\n");
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-a shm|libc|both] [-w workload|all] [-n ops] [-s seed] [-q quickLimit]\n", prog);
+	fprintf(stderr, "       [-f policy|all] [-g fitPercent] [-m minSplit] [-c]\n");
+	fprintf(stderr, "Workloads: uniform skewed prodcons realloc fragment\n");
+	fprintf(stderr, "Policies: good best first next\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *allocName = "both";
+	const char *workloadName = "all";
+	const char *policyName = NULL;
+	size_t ops = 1000000;
+	size_t ai, wi, pi;
+	int opt;
+
+	while((opt = getopt(argc, argv, "a:w:n:s:q:f:g:m:c")) != -1) {
+		switch(opt) {
+		case 'a': allocName = optarg;                  break;
+		case 'w': workloadName = optarg;               break;
+		case 'n': ops = strtoul(optarg, NULL, 0);      break;
+		case 's': seed = strtoul(optarg, NULL, 0) | 1; break;
+		case 'q': shmOpts.quickLimit = strtoul(optarg, NULL, 0); break;
+		case 'f': policyName = optarg;                 break;
+		case 'g': shmOpts.fitPercent = (unsigned) atoi(optarg); break;
+		case 'm': shmOpts.minSplit = strtoul(optarg, NULL, 0); break;
+		case 'c': check = 1;                           break;
+		default:  usage(argv[0]);
+		}
+	}
+	if(ops == 0) {
+		usage(argv[0]);
+	}
+
+	Result res;
+	res.ns = malloc(ops * sizeof(res.ns[0]));
+	if(res.ns == NULL) {
+		fprintf(stderr, "Unable to allocate %zu timings\n", ops);
+		return EXIT_FAILURE;
+	}
+
+	int ran = 0;
+	for(wi = 0; wi < WORKLOAD_COUNT; wi++) {
+		Workload *w = &workloads[wi];
+		if(strcmp(workloadName, "all") != 0 && strcmp(workloadName, w->name) != 0) {
+			continue;
+		}
+
+		for(ai = 0; ai < ALLOCATOR_COUNT; ai++) {
+			Allocator *a = &allocators[ai];
+			if(strcmp(allocName, "both") != 0 && strcmp(allocName, a->name) != 0) {
+				continue;
+			}
+
+			/* Only shmHeap has placement policies.  Without -f it just
+			 * runs once, with its default. */
+			for(pi = 0; pi < POLICY_COUNT; pi++) {
+				char label[32];
+
+				if(a->init == shmInit && policyName) {
+					if(strcmp(policyName, "all") != 0 && strcmp(policyName, policies[pi].name) != 0) {
+						continue;
+					}
+					shmOpts.fitPolicy = policies[pi].fitPolicy;
+					snprintf(label, sizeof(label), "%s-%s", a->name, policies[pi].name);
+				}
+				else if(pi == 0) {
+					snprintf(label, sizeof(label), "%s", a->name);
+				}
+				else {
+					break;
+				}
+
+				if(a->init() != 0) {
+					fprintf(stderr, "%s: unable to initialize\n", label);
+					return EXIT_FAILURE;
+				}
+
+				res.ops = 0;
+				res.peakFrag = -1.0;
+				liveBytes = 0;
+
+				uint64_t start = nowNs();
+				w->run(a, &res, ops);
+				res.seconds = (nowNs() - start) / 1e9;
+
+				a->fini();
+				report(label, w, &res);
+				ran++;
+			}
+		}
+	}
+
+	if(ran == 0) {
+		usage(argv[0]);
+	}
+	if(check) {
+		printf("All checks passed.\n");
+	}
+
+	free(res.ns);
+	return 0;
+}
@@ -1,4 +1,7 @@
 #!/bin/bash
 
-gcc main.c shmHeap.c -o main
-
+gcc main.c shmHeap.c -o main -pthread
+gcc -O2 bench.c shmHeap.c -o bench -pthread
+gcc -O2 mpbench.c shmHeap.c -o mpbench -pthread
+gcc -O2 shmtrace.c shmHeap.c -o shmtrace -pthread
+gcc -O2 replay.c shmHeap.c -o replay -pthread
@@ -27,7 +27,10 @@
 #define MAX_HEAP_SIZE	(1024*1024*64)
 #define MAX_ALLOC_SIZE (MAX_HEAP_SIZE/1000)
 
-/* Set to 1 for non-deterministic seeding after each execution */
+/* Set to 1 for non-deterministic seeding after each execution.  A seed given
+ * on the command line ("./main 1234") always wins, so a failing run can be
+ * repeated.  A file name after the seed ("./main 1234 run.trace") records the
+ * run in the format that "replay" reads. */
 #define PSEUDO_RANDOM_SEED	1
 
 #define ALLOC_CONST	0.5
@@ -61,8 +64,20 @@ int main(int argc, char **argv)
 	/* Set the PSEUDO_RANDOM_SEED for pseduo random seed initialization based on time, i.e.,
  	 * the random values changes after each execution
  	 */
-	if(PSEUDO_RANDOM_SEED)
-		SEED(time(NULL));
+	unsigned int seed = 1;
+	if(argc > 1)
+		seed = (unsigned int) strtoul(argv[1], NULL, 0);
+	else if(PSEUDO_RANDOM_SEED)
+		seed = (unsigned int) time(NULL);
+	printf("Seed %u\n", seed);
+	SEED(seed);
+
+	FILE *capture = NULL;
+	long int lifetime[BUFLEN];
+	if(argc > 2 && (capture = fopen(argv[2], "w")) == NULL) {
+		perror(argv[2]);
+		exit(EXIT_FAILURE);
+	}
 
 	assert(MAX_HEAP_SIZE >= 1024*1024 && "MAX_HEAP_SIZE is too low; Recommended setting is at least 1MB for test_stress2");
 
@@ -105,6 +120,9 @@ int main(int argc, char **argv)
 					exit(EXIT_FAILURE);
 				}
 			}
+			if(capture)
+				fprintf(capture, "m %d %d\n", i, size);
+			lifetime[itr] = i;
 			global[i][0] = (long int) ptr[itr];
 			global[i][1] = (long int) ptr[itr] + size;
 			printf("Assigned: [s] = %ld, [e] = %ld, [p] = %ld, [itr] = %d, [size] = %ld\n", global[i][0], global[i][1], ptr[itr],i, size);
@@ -117,6 +135,8 @@ int main(int argc, char **argv)
 					global[j][1] = -1;
 				}
 			}
+			if(capture)
+				fprintf(capture, "f %ld\n", lifetime[itr]);
 			shmHeapFree(ptr[itr]);
 			ptr[itr] = NULL;
 		}
@@ -133,11 +153,15 @@ int main(int argc, char **argv)
  	 */
 	for(i=0; i < BUFLEN; i++) {
 		if(ptr[i] != NULL) {
+			if(capture)
+				fprintf(capture, "f %ld\n", lifetime[i]);
 			shmHeapFree(ptr[i]);
 			ptr[i] = NULL;
 		}
 	}
 	end = clock();
+	if(capture)
+		fclose(capture);
 
 	//print_freelists();
 	DEBUG("\n");
@@ -0,0 +1,345 @@
+/*******************************************************************************
+ * This benchmark measures how the heap scales when several processes share
+ * it.  For each worker count in the sweep, it creates a fresh heap, forks
+ * that many workers, and lets them all allocate and free at the same time.
+ * Some of each worker's allocations are handed to the next worker, which frees
+ * them, so the cross-process free path gets exercised as well as the local
+ * one.
+ *
+ * Usage: mpbench [-p maxWorkers] [-n opsPerWorker] [-r remotePercent] [-a cpuArenas] [-v]
+ *
+ * For each worker count it prints the aggregate throughput, the latency
+ * percentiles over all workers, and how long the workers spent waiting for the
+ * heap lock.  With -v it also prints each worker's latency histogram.  With -a
+ * the heap is split into that many CPU Arenas.
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmHeap.h"
+
+#define HEAP_INITIAL_SIZE (64 * 1024 * 1024)
+#define HEAP_MAX_SIZE     (4096UL * 1024 * 1024)
+
+/* The most workers we'll run. */
+#define MAX_WORKERS (64)
+
+/* The number of live allocations each worker juggles. */
+#define SLOTS (1024)
+
+/* The queue that each worker uses to hand allocations to the next one. */
+#define RING_LEN (4096)
+
+/* Latencies are counted in power-of-2 buckets, from <=32ns up. */
+#define BUCKET_SHIFT (5)
+#define BUCKETS      (16)
+
+/* One worker's queue of allocations for the next worker to free.  Only this
+ * worker pushes and only the next one pops. */
+typedef struct ring {
+	void *ptr[RING_LEN];
+	size_t head;
+	size_t tail;
+} Ring;
+
+typedef struct worker {
+	Ring ring;
+	uint64_t hist[BUCKETS];
+	uint64_t ops;
+	uint64_t failed;
+} Worker;
+
+/* This is shared by the parent and all of the workers.  It lives in its own
+ * mapping so it doesn't disturb the heap. */
+typedef struct shared {
+	int go;
+	int done;
+	Worker workers[MAX_WORKERS];
+} Shared;
+
+static Shared *shared;
+static size_t opsPerWorker = 200000;
+static unsigned remotePercent = 25;
+static unsigned cpuArenas = 0;
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void record(Worker *w, uint64_t start)
+{
+	uint64_t ns = nowNs() - start;
+	int bucket = 0;
+
+	while(bucket < BUCKETS - 1 && ns > ((uint64_t) 1 << (bucket + BUCKET_SHIFT))) {
+		bucket++;
+	}
+	w->hist[bucket]++;
+	w->ops++;
+}
+
+/* Free whatever the previous worker has handed us. */
+static void drainRing(Worker *w, Ring *ring)
+{
+	size_t tail = ring->tail;
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while(tail != head) {
+		uint64_t start = nowNs();
+		shmHeapFree(ring->ptr[tail % RING_LEN]);
+		record(w, start);
+		tail++;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void runWorker(int id, int count)
+{
+	Worker *w = &shared->workers[id];
+	Ring *in = &shared->workers[(id + count - 1) % count].ring;
+	static void *slots[SLOTS];
+	uint64_t rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+	size_t op;
+
+	__atomic_add_fetch(&shared->done, 1, __ATOMIC_ACQ_REL);
+	while(!__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	for(op = 0; op < opsPerWorker; op++) {
+		uint64_t r = nextRandom(&rng);
+		int i = r % SLOTS;
+
+		if((op & 63) == 0) {
+			drainRing(w, in);
+		}
+
+		if(slots[i] == NULL) {
+			size_t size = (r >> 16) % 8 ? 16 + (r >> 24) % 256 : 1 + (r >> 24) % 16384;
+			uint64_t start = nowNs();
+			slots[i] = shmHeapMalloc(size);
+			record(w, start);
+			if(slots[i] == NULL) {
+				w->failed++;
+			}
+			continue;
+		}
+
+		/* Hand it to the next worker, if there's room in the queue. */
+		Ring *out = &w->ring;
+		if(count > 1 && (r >> 32) % 100 < remotePercent &&
+		   out->head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) < RING_LEN) {
+			out->ptr[out->head % RING_LEN] = slots[i];
+			__atomic_store_n(&out->head, out->head + 1, __ATOMIC_RELEASE);
+		}
+		else {
+			uint64_t start = nowNs();
+			shmHeapFree(slots[i]);
+			record(w, start);
+		}
+		slots[i] = NULL;
+	}
+
+	for(op = 0; op < SLOTS; op++) {
+		shmHeapFree(slots[op]);
+	}
+
+	/* Wait for the next worker to free everything we handed it, while
+	 * freeing whatever the previous worker handed us. */
+	__atomic_sub_fetch(&shared->done, 1, __ATOMIC_ACQ_REL);
+	while(__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE) > 0 ||
+	      in->tail != __atomic_load_n(&in->head, __ATOMIC_ACQUIRE)) {
+		drainRing(w, in);
+		sched_yield();
+	}
+}
+
+/* Return the upper bound (in ns) of the bucket that holds fraction "p" of
+ * the operations in "hist". */
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p)
+{
+	uint64_t want = (uint64_t) (p * total);
+	uint64_t seen = 0;
+	int b;
+
+	for(b = 0; b < BUCKETS; b++) {
+		seen += hist[b];
+		if(seen > want) {
+			break;
+		}
+	}
+	return (uint64_t) 1 << ((b < BUCKETS ? b : BUCKETS - 1) + BUCKET_SHIFT);
+}
+
+static void printHist(const char *label, const uint64_t *hist)
+{
+	int b;
+
+	printf("    %-8s", label);
+	for(b = 0; b < BUCKETS; b++) {
+		printf(" %8llu", (unsigned long long) hist[b]);
+	}
+	printf("\n");
+}
+
+static int runSweep(int count, int verbose)
+{
+	int i;
+
+	ShmHeapOptions opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.cpuArenas = cpuArenas;
+
+	memset(shared, 0, sizeof(*shared));
+	if(shmHeapCreateWithOptions(NULL, HEAP_INITIAL_SIZE, HEAP_MAX_SIZE, &opts) != 0) {
+		return -1;
+	}
+
+	/* Don't let the workers inherit (and later repeat) buffered output. */
+	fflush(stdout);
+
+	for(i = 0; i < count; i++) {
+		pid_t pid = fork();
+		if(pid < 0) {
+			perror("fork");
+			return -1;
+		}
+		if(pid == 0) {
+			runWorker(i, count);
+			exit(0);
+		}
+	}
+
+	/* Start everybody at once. */
+	while(__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE) < count) {
+		sched_yield();
+	}
+	ShmHeapLockStats before, after;
+	shmHeapGetLockStats(&before);
+	uint64_t start = nowNs();
+	__atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+
+	int failed = 0;
+	for(i = 0; i < count; i++) {
+		int status;
+		wait(&status);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	double seconds = (nowNs() - start) / 1e9;
+	shmHeapGetLockStats(&after);
+
+	uint64_t hist[BUCKETS] = { 0 };
+	uint64_t ops = 0, oom = 0;
+	int b;
+	for(i = 0; i < count; i++) {
+		for(b = 0; b < BUCKETS; b++) {
+			hist[b] += shared->workers[i].hist[b];
+		}
+		ops += shared->workers[i].ops;
+		oom += shared->workers[i].failed;
+	}
+
+	uint64_t acquired = after.acquired - before.acquired;
+	uint64_t contended = after.contended - before.contended;
+	double waitMs = (after.waitNs - before.waitNs) / 1e6;
+
+	printf("%3d workers %10llu ops %8.2f Mops/s  p50 <=%5llu ns  p99 <=%6llu ns  p999 <=%7llu ns  "
+	       "lock %llu taken, %.1f%% contended, %.1f ms waiting%s\n",
+	       count, (unsigned long long) ops, ops / seconds / 1e6,
+	       (unsigned long long) percentile(hist, ops, 0.50),
+	       (unsigned long long) percentile(hist, ops, 0.99),
+	       (unsigned long long) percentile(hist, ops, 0.999),
+	       (unsigned long long) acquired, acquired ? 100.0 * contended / acquired : 0.0, waitMs,
+	       oom ? "  (some mallocs failed)" : "");
+
+	if(verbose) {
+		printf("    %-8s", "<=ns");
+		for(b = 0; b < BUCKETS; b++) {
+			printf(" %8llu", (unsigned long long) 1 << (b + BUCKET_SHIFT));
+		}
+		printf("\n");
+		for(i = 0; i < count; i++) {
+			char label[16];
+			snprintf(label, sizeof(label), "worker%d", i);
+			printHist(label, shared->workers[i].hist);
+		}
+	}
+
+	shmHeapDetach();
+	return failed ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p maxWorkers] [-n opsPerWorker] [-r remotePercent] [-a cpuArenas] [-v]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int maxWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int verbose = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:n:r:a:v")) != -1) {
+		switch(opt) {
+		case 'p': maxWorkers = atoi(optarg);                      break;
+		case 'n': opsPerWorker = strtoul(optarg, NULL, 0);        break;
+		case 'r': remotePercent = (unsigned) atoi(optarg);        break;
+		case 'a': cpuArenas = (unsigned) atoi(optarg);            break;
+		case 'v': verbose = 1;                                    break;
+		default:  usage(argv[0]);
+		}
+	}
+	if(maxWorkers < 1 || maxWorkers > MAX_WORKERS || opsPerWorker == 0 ||
+	   cpuArenas > SHM_HEAP_MAX_CPU_ARENAS) {
+		usage(argv[0]);
+	}
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	/* 1, 2, 4, ... and then maxWorkers itself. */
+	int count;
+	for(count = 1; ; count *= 2) {
+		if(count > maxWorkers) {
+			count = maxWorkers;
+		}
+		if(runSweep(count, verbose) != 0) {
+			fprintf(stderr, "The run with %d workers failed.\n", count);
+			return EXIT_FAILURE;
+		}
+		if(count == maxWorkers) {
+			break;
+		}
+	}
+
+	return 0;
+}
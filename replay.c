@@ -0,0 +1,479 @@
+/*******************************************************************************
+ * This replays a recorded sequence of allocations against the heap, as fast
+ * as it can, so that a change to the allocator can be checked against real
+ * allocation patterns.
+ *
+ * Usage: replay [-t] [-r repeat] [-m maxMB] trace
+ *
+ * A trace is a text file with one call per line:
+ *
+ *     m <id> <size> [thread]     malloc <size> bytes for lifetime <id>
+ *     r <id> <size> [thread]     realloc lifetime <id> to <size> bytes
+ *     f <id> [thread]            free lifetime <id>
+ *
+ * <id> is any number that names an allocation from its malloc to its free,
+ * and it can be used again once it's been freed.  [thread] says which thread
+ * made the call, and defaults to 0.  Blank lines and lines that start with '#'
+ * are ignored.  "main <seed> <file>" and "shmtrace -c" both write traces.
+ *
+ * A trace taken from a Trace Ring can be missing calls.  A call on an id that
+ * isn't allocated is skipped, and a malloc of an id that's still allocated
+ * leaves the old allocation allocated until the end.  Both are counted.
+ *
+ * By default the whole trace is replayed in order on one thread, so every run
+ * does exactly the same thing.  With -t, each thread in the trace gets a
+ * thread of its own, and a call only waits for the earlier calls on the same
+ * allocation.
+ *
+ * For each run it prints the time taken, the peak number of bytes in use, the
+ * peak footprint (the bytes in the heap's chunks, in use or free, sampled
+ * from the heap's statistics every SAMPLE_INTERVAL calls), the fragmentation
+ * at the peak (the fraction of the peak footprint that wasn't in use, from
+ * the same sample), and how fragmented the free space was at the end of the
+ * trace.
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmHeap.h"
+
+/* The heap starts small and grows as the trace needs it, so the footprint
+ * follows the trace. */
+#define HEAP_INITIAL_SIZE (1024 * 1024)
+
+/* How often (in calls, on each thread) to sample the footprint. */
+#define SAMPLE_INTERVAL (1024)
+
+/* The most threads a trace can have with -t. */
+#define MAX_THREADS (256)
+
+#define OP_MALLOC  'm'
+#define OP_REALLOC 'r'
+#define OP_FREE    'f'
+
+/* One call from the trace.  "life" is the allocation it works on, numbered
+ * from 0 in the order they were malloc'd, and "ord" is which call on that
+ * allocation this is (the malloc is 0). */
+typedef struct op {
+	char type;
+	uint32_t thread;
+	uint32_t ord;
+	size_t life;
+	size_t size;
+} Op;
+
+/* One allocation, while the trace is running.  "done" is how many of its
+ * calls have finished. */
+typedef struct life {
+	void *ptr;
+	uint32_t done;
+} Life;
+
+/* What one thread (or the whole run, without -t) saw.  "footprint" is the
+ * biggest footprint it sampled, and "inUse" is what was in use in that same
+ * sample. */
+typedef struct thread {
+	pthread_t tid;
+	size_t *ops;
+	size_t count;
+	uint64_t footprint;
+	uint64_t inUse;
+	uint64_t failed;
+} Thread;
+
+static Op *ops;
+static size_t opCount;
+static Life *lives;
+static size_t lifeCount;
+static Thread threads[MAX_THREADS];
+static uint32_t threadIds[MAX_THREADS];
+static unsigned int threadCount;
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * This turns the trace into an array of Ops.  It's done before the clock
+ * starts.
+ ******************************************************************************/
+
+/* A table from the trace's ids to the allocations they currently name.  It
+ * uses open addressing, and it's rebuilt twice as big when it's half full. */
+typedef struct idEntry {
+	uint64_t id;
+	size_t life;
+	int used;
+} IdEntry;
+
+static IdEntry *idTable;
+static size_t idTableSize;
+static size_t idTableCount;
+
+static IdEntry *idFind(uint64_t id)
+{
+	size_t i = (size_t) (id * 0x9E3779B97F4A7C15ULL) & (idTableSize - 1);
+
+	while(idTable[i].used && idTable[i].id != id) {
+		i = (i + 1) & (idTableSize - 1);
+	}
+	return &idTable[i];
+}
+
+static void idInsert(uint64_t id, size_t life)
+{
+	if(2 * (idTableCount + 1) > idTableSize) {
+		IdEntry *old = idTable;
+		size_t oldSize = idTableSize, i;
+
+		idTableSize = (idTableSize) ? idTableSize * 2 : 1024;
+		idTable = calloc(idTableSize, sizeof(*idTable));
+		for(i = 0; i < oldSize; i++) {
+			if(old[i].used) {
+				*idFind(old[i].id) = old[i];
+			}
+		}
+		free(old);
+	}
+
+	IdEntry *e = idFind(id);
+	if(!e->used) {
+		idTableCount++;
+	}
+	e->id = id;
+	e->life = life;
+	e->used = 1;
+}
+
+/* Take "id" out of the table.  The entries after it are put back, so nothing
+ * that collided with it gets lost. */
+static void idRemove(IdEntry *e)
+{
+	size_t i = (size_t) (e - idTable);
+
+	e->used = 0;
+	idTableCount--;
+	for(i = (i + 1) & (idTableSize - 1); idTable[i].used; i = (i + 1) & (idTableSize - 1)) {
+		IdEntry moved = idTable[i];
+		idTable[i].used = 0;
+		*idFind(moved.id) = moved;
+	}
+}
+
+static uint32_t threadIndex(uint32_t id)
+{
+	unsigned int i;
+
+	for(i = 0; i < threadCount; i++) {
+		if(threadIds[i] == id) {
+			return i;
+		}
+	}
+	if(threadCount == MAX_THREADS) {
+		fprintf(stderr, "The trace has more than %d threads.\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+	threadIds[threadCount] = id;
+	return threadCount++;
+}
+
+static int loadTrace(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	size_t opMax = 0, *ords = NULL, lineNo = 0, skipped = 0, leaked = 0;
+	char line[256];
+
+	while(fgets(line, sizeof(line), fp)) {
+		char type;
+		uint64_t id;
+		unsigned long long size = 0;
+		unsigned int thread = 0;
+		int n;
+
+		lineNo++;
+		if(line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if(sscanf(line, " %c %" SCNu64 " %n", &type, &id, &n) != 2) {
+			goto bad;
+		}
+		if(type == OP_MALLOC || type == OP_REALLOC) {
+			if(sscanf(line + n, "%llu %u", &size, &thread) < 1) {
+				goto bad;
+			}
+		}
+		else if(type == OP_FREE) {
+			sscanf(line + n, "%u", &thread);
+		}
+		else {
+			goto bad;
+		}
+
+		/* A malloc starts a new allocation, even if the id was used
+		 * before. */
+		IdEntry *e = idTable ? idFind(id) : NULL;
+		if(type != OP_MALLOC && (e == NULL || !e->used)) {
+			skipped++;
+			continue;
+		}
+
+		if(opCount == opMax) {
+			opMax = (opMax) ? opMax * 2 : 65536;
+			ops = realloc(ops, opMax * sizeof(*ops));
+		}
+		Op *op = &ops[opCount];
+		op->type = type;
+		op->thread = threadIndex(thread);
+		op->size = (size_t) size;
+
+		if(type == OP_MALLOC) {
+			if(e && e->used) {
+				leaked++;
+			}
+			if((lifeCount & (lifeCount - 1)) == 0) {
+				ords = realloc(ords, (lifeCount ? lifeCount * 2 : 1) * sizeof(*ords));
+			}
+			ords[lifeCount] = 0;
+			idInsert(id, lifeCount++);
+			e = idFind(id);
+		}
+
+		op->life = e->life;
+		op->ord = (uint32_t) ords[e->life]++;
+		if(type == OP_FREE) {
+			idRemove(e);
+		}
+		opCount++;
+		continue;
+
+bad:
+		fprintf(stderr, "%s:%zu: can't parse \"%.*s\".\n", path, lineNo,
+		        (int) strcspn(line, "\n"), line);
+		goto fail;
+	}
+
+	if(skipped || leaked) {
+		fprintf(stderr, "%s: WARNING: %zu calls on ids that weren't allocated were skipped, and "
+		        "%zu allocations were never freed.\n", path, skipped, leaked);
+	}
+
+	fclose(fp);
+	free(ords);
+	free(idTable);
+	idTable = NULL;
+	idTableSize = idTableCount = 0;
+
+	/* Hand each thread the list of its own calls. */
+	size_t i;
+	for(i = 0; i < opCount; i++) {
+		threads[ops[i].thread].count++;
+	}
+	for(i = 0; i < threadCount; i++) {
+		threads[i].ops = malloc((threads[i].count + 1) * sizeof(size_t));
+		threads[i].count = 0;
+	}
+	for(i = 0; i < opCount; i++) {
+		Thread *t = &threads[ops[i].thread];
+		t->ops[t->count++] = i;
+	}
+
+	lives = calloc(lifeCount + 1, sizeof(*lives));
+	return 0;
+
+fail:
+	fclose(fp);
+	free(ords);
+	return -1;
+}
+
+/*******************************************************************************
+ * This runs the trace.
+ ******************************************************************************/
+
+/* Remember the biggest footprint "t" has seen. */
+static void sample(Thread *t)
+{
+	ShmHeapStats stats;
+
+	shmHeapGetStats(&stats);
+	if(stats.inUseBytes + stats.freeBytes > t->footprint) {
+		t->footprint = stats.inUseBytes + stats.freeBytes;
+		t->inUse = stats.inUseBytes;
+	}
+}
+
+static void runOp(Thread *t, const Op *op)
+{
+	Life *life = &lives[op->life];
+	void *ptr;
+
+	switch(op->type) {
+	case OP_MALLOC:
+		life->ptr = shmHeapMalloc(op->size);
+		if(life->ptr == NULL) {
+			t->failed++;
+		}
+		break;
+
+	case OP_REALLOC:
+		ptr = shmHeapRealloc(life->ptr, op->size);
+		if(ptr == NULL && op->size) {
+			t->failed++;
+		}
+		else {
+			life->ptr = ptr;
+		}
+		break;
+
+	case OP_FREE:
+		shmHeapFree(life->ptr);
+		life->ptr = NULL;
+		break;
+	}
+}
+
+/* Run one thread's calls.  Each call waits until the calls before it on the
+ * same allocation (which may belong to other threads) have finished. */
+static void *runThread(void *arg)
+{
+	Thread *t = arg;
+	size_t i;
+
+	for(i = 0; i < t->count; i++) {
+		const Op *op = &ops[t->ops[i]];
+		Life *life = &lives[op->life];
+
+		while(__atomic_load_n(&life->done, __ATOMIC_ACQUIRE) != op->ord) {
+			sched_yield();
+		}
+		runOp(t, op);
+		__atomic_store_n(&life->done, op->ord + 1, __ATOMIC_RELEASE);
+
+		if(i % SAMPLE_INTERVAL == 0) {
+			sample(t);
+		}
+	}
+
+	shmHeapCacheFlush();
+	return NULL;
+}
+
+static int replay(int threaded, size_t maxSize)
+{
+	size_t i;
+	unsigned int n;
+
+	if(shmHeapCreate(NULL, HEAP_INITIAL_SIZE, maxSize) != 0) {
+		return -1;
+	}
+	memset(lives, 0, (lifeCount + 1) * sizeof(*lives));
+
+	Thread all;
+	memset(&all, 0, sizeof(all));
+	for(n = 0; n < threadCount; n++) {
+		threads[n].footprint = 0;
+		threads[n].inUse = 0;
+		threads[n].failed = 0;
+	}
+
+	uint64_t start = nowNs();
+	if(threaded) {
+		for(n = 0; n < threadCount; n++) {
+			pthread_create(&threads[n].tid, NULL, runThread, &threads[n]);
+		}
+		for(n = 0; n < threadCount; n++) {
+			pthread_join(threads[n].tid, NULL);
+			if(threads[n].footprint > all.footprint) {
+				all.footprint = threads[n].footprint;
+				all.inUse = threads[n].inUse;
+			}
+			all.failed += threads[n].failed;
+		}
+	}
+	else {
+		for(i = 0; i < opCount; i++) {
+			runOp(&all, &ops[i]);
+			if(i % SAMPLE_INTERVAL == 0) {
+				sample(&all);
+			}
+		}
+	}
+	double seconds = (nowNs() - start) / 1e9;
+	sample(&all);
+
+	/* Look at the free space with whatever the trace left allocated still
+	 * allocated.  Cached chunks don't count as free, so give them back
+	 * first. */
+	ShmHeapStats stats;
+	shmHeapCacheFlush();
+	shmHeapGetStats(&stats);
+
+	size_t footprint = all.footprint;
+	double frag = (footprint > all.inUse) ? 1.0 - (double) all.inUse / footprint : 0.0;
+
+	printf("%10zu ops %9.3f s %8.2f Mops/s  peak in use %12" PRIu64 "  peak footprint %12zu  "
+	       "frag %5.1f%%  free space frag %5.1f%% in %" PRIu64 " chunks%s\n",
+	       opCount, seconds, opCount / seconds / 1e6, stats.peakInUseBytes, footprint,
+	       100.0 * frag, 100.0 * stats.fragmentation, stats.freeChunks,
+	       all.failed ? "  (some allocations failed)" : "");
+
+	for(i = 0; i < lifeCount; i++) {
+		shmHeapFree(lives[i].ptr);
+	}
+	shmHeapDetach();
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t] [-r repeat] [-m maxMB] trace\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	size_t maxSize = 4096UL * 1024 * 1024;
+	int threaded = 0, repeat = 1, opt, i;
+
+	while((opt = getopt(argc, argv, "tr:m:")) != -1) {
+		switch(opt) {
+		case 't': threaded = 1;                                              break;
+		case 'r': repeat = atoi(optarg);                                     break;
+		case 'm': maxSize = (size_t) strtoul(optarg, NULL, 0) * 1024 * 1024; break;
+		default:  usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || repeat < 1) {
+		usage(argv[0]);
+	}
+
+	if(loadTrace(argv[optind]) != 0) {
+		return EXIT_FAILURE;
+	}
+	printf("%s: %zu calls, %zu allocations, %u threads.\n", argv[optind], opCount, lifeCount, threadCount);
+
+	for(i = 0; i < repeat; i++) {
+		if(replay(threaded, maxSize) != 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
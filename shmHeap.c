@@ -1,591 +1,4709 @@
 
+#define _GNU_SOURCE
 #define __STDC_FORMAT_MACROS
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "shmHeap.h"
 
 /*******************************************************************************
- * We maintain a Size Tree and an Address Tree.
+ * We maintain Size Bins, a Size Tree and boundary tags.
  *
- * - The Size Tree is used to locate the smallest suitable chunk of free
- *   memory available when doing a malloc.
+ * - The Size Bins hold the small free chunks.  They're segregated by size
+ *   class, so a suitable chunk is found in constant time when doing a malloc.
  *
- * - The Address Tree is used to help recombine chunks when they are freed.
+ * - The Size Tree holds the large free chunks.  It is used to locate the
+ *   smallest suitable one when doing a large malloc.
+ *
+ * - The boundary tags are used to help recombine chunks when they are freed.
+ *   Every chunk header records the size of the chunk that physically
+ *   precedes it, so both neighbors can be found with pointer arithmetic.
  *   The recombining is done to reduce fragmentation.
+ *
+ * All of this lives inside the heap itself.  The roots of the Size Tree and
+ * the Size Bins are kept in the privateData header at the start of the heap,
+ * and every link is stored as an offset from that header instead of as a
+ * pointer.  That way any process that maps the heap, at any address, can
+ * allocate and free from it.
+ *
+ * The Size Bins and the Size Tree are protected by a process-shared, robust
+ * mutex that also lives in the privateData header.  Each thread keeps a small
+ * cache of free chunks in front of them, so most small mallocs and frees never
+ * take the lock.  A chunk that's freed by a process other than the one that
+ * allocated it goes onto a lock-free queue for its owner instead.
  ******************************************************************************/
 
-struct allocStruct;
+#define SHM_HEAP_MAGIC 0xDEBB1E83
 
-static void _shmHeapFree(void *ptr, int external);
+/* This goes up whenever the layout of the heap changes, so that a heap that
+ * was saved in a file by older code isn't misread. */
+#define SHM_HEAP_VERSION 1
 
-#define SHM_HEAP_MAGIC 0xDEBB1E83
+/* This goes in the "prevSize" boundary tag of the first chunk in a heap.  It
+ * means there is no chunk in front of it to combine with. */
+#define SHM_HEAP_NO_PREV ((size_t) -1)
 
-/******************************************************************************
- ******************************************************************************
- **** This is the implementation of the Size Tree.
- ******************************************************************************
- ******************************************************************************/
-/* This is the definition of the Size Tree. */
+/* These describe the Size Bins.  See the Size Bins section below. */
+#define SHM_HEAP_ALIGN_LOG2   3
+#define SHM_HEAP_ALIGN        (1 << SHM_HEAP_ALIGN_LOG2)
+#define SHM_HEAP_SL_LOG2      4
+#define SHM_HEAP_SL_COUNT     (1 << SHM_HEAP_SL_LOG2)
+#define SHM_HEAP_FL_SHIFT     (SHM_HEAP_SL_LOG2 + SHM_HEAP_ALIGN_LOG2)
+#define SHM_HEAP_SMALL_SIZE   (1 << SHM_HEAP_FL_SHIFT)
+#define SHM_HEAP_FL_MAX_LOG2  20
+#define SHM_HEAP_FL_COUNT     (SHM_HEAP_FL_MAX_LOG2 - SHM_HEAP_FL_SHIFT + 1)
+#define SHM_HEAP_LARGE_SIZE   ((size_t) 1 << SHM_HEAP_FL_MAX_LOG2)
+
+/* The huge page size we use when the heap is backed by huge pages. */
+#define SHM_HEAP_HUGE_PAGE    ((size_t) 2 * 1024 * 1024)
+
+/* The most processes that can have their own Remote Free Queue. */
+#define SHM_HEAP_MAX_PROCS    64
+
+/* The biggest chunk that can go on a Quick List, and the number of lists. */
+#define SHM_HEAP_QUICK_MAX_SIZE  2048
+#define SHM_HEAP_QUICK_BINS      ((SHM_HEAP_QUICK_MAX_SIZE >> SHM_HEAP_ALIGN_LOG2) + 1)
+
+/* This is a location inside the heap, measured in bytes from the start of the
+ * privateData header.  Nothing but the header lives at offset 0, so 0 is used
+ * as the NULL offset. */
+typedef int64_t ShmOffset;
+
+/* This is the definition of the Size Tree.  It's a red-black tree, so the
+ * depth stays at O(log n) no matter what order chunks are freed in.  All of
+ * the tree operations are iterative.
+ *
+ * A free chunk keeps one of these at the start of its data area.  The Size
+ * Bins only use "next" and "prev", so that's all a small free chunk has to
+ * have room for.  Only chunks in the Size Tree (which are all large) use the
+ * rest of it.
+ */
 typedef struct sizeTree {
-	struct sizeTree *left;
-	struct sizeTree *right;
+	/* This is a doubly linked list of all of the chunks.  There can be
+	 * more than one chunk of free memory that is "size" bytes long.  We
+	 * store them all together.  Only the head of the list is linked into
+	 * the tree.  The head has a NULL "prev", and everything else on the
+	 * list has a non-NULL "prev". */
+	ShmOffset next;
+	ShmOffset prev;
+
+	ShmOffset left;
+	ShmOffset right;
+	ShmOffset parent;
+	int red;
 
 	/* This is the key.  It represents the size of each chunk of memory
 	 * in this node.  All of the chunks of memory in a node are the same
 	 * size. */
 	size_t size;
 
-	/* This is a pointer to our internal data structure. */
-	struct allocStruct *ptr;
+	/* When the chunk was freed (see shmHeapNow()).  Only chunks of at
+	 * least "purgeThreshold" bytes keep track of it. */
+	uint64_t freedAt;
+} SizeTree;
+
+/* The smallest data area a chunk can have.  It has to hold the Size Bin
+ * links once the chunk is freed. */
+#define SHM_HEAP_MIN_SIZE     (2 * sizeof(ShmOffset))
+
+/* This is the data structure that is used for each chunk of allocated mem.
+ * It's kept to two words, because every allocation pays for it. */
+typedef struct allocStruct {
+	/* This is the boundary tag.  It's the "size" of the chunk that sits
+	 * immediately in front of this one, or SHM_HEAP_NO_PREV. */
+	size_t prevSize;
+
+	/* The number of bytes in "data".  It's always a multiple of
+	 * SHM_HEAP_ALIGN. */
+	uint64_t size      : 48;
+
+	/* 0 if the chunk is free, 1 if it's in use, or one of the other
+	 * SHM_HEAP_* states below. */
+	uint64_t allocated : 2;
+
+	/* The ProcSlot of the process that allocated this chunk, or -1. */
+	int64_t owner      : 7;
+
+	/* 1 if the chunk is free and its pages have been given back to the
+	 * OS.  See the Page Purging section. */
+	uint64_t purged    : 1;
+
+	/* SHM_HEAP_CHUNK_MAGIC, so we can catch bad pointers. */
+	uint64_t magic     : 6;
+
+	/* The actual data.  A free chunk keeps its SizeTree node here. */
+	unsigned char data[0];
+} AllocStruct;
+static size_t AllocStructDataOffset = (size_t) (&((AllocStruct *)0)->data);
+
+#define SHM_HEAP_CHUNK_MAGIC  0x2B
+
+/* Get the chunk header for a pointer that shmHeapMalloc() handed out. */
+static AllocStruct *chunkFromData(void *ptr)
+{
+	return (AllocStruct *) ((unsigned char *) ptr - AllocStructDataOffset);
+}
+
+/* Get the Size Index node of a free chunk. */
+static SizeTree *chunkNode(AllocStruct *curr)
+{
+	return (SizeTree *) curr->data;
+}
+
+/* Get the chunk that sits immediately after "curr" in memory. */
+static AllocStruct *chunkNext(AllocStruct *curr)
+{
+	return (AllocStruct *) ((unsigned char *) curr + AllocStructDataOffset + curr->size);
+}
+
+/* Move "curr" from in use (1) to "state" with a single compare-and-swap on the
+ * header word that holds "allocated".  Some frees don't take the lock, so this
+ * is what makes sure that only one of two racing frees of the same pointer
+ * gets the chunk.  Returns 0 if the chunk wasn't in use (a double free).
+ */
+static int chunkClaim(AllocStruct *curr, unsigned state)
+{
+	typedef uint64_t __attribute__((may_alias)) ChunkWord;
+	ChunkWord *word = (ChunkWord *) ((unsigned char *) curr + sizeof(curr->prevSize));
+	union {
+		AllocStruct chunk;
+		uint64_t word[2];
+	} old, new;
+
+	old.word[1] = __atomic_load_n(word, __ATOMIC_RELAXED);
+	do {
+		if(old.chunk.allocated != 1) {
+			return 0;
+		}
+		new.word[1] = old.word[1];
+		new.chunk.allocated = state;
+	} while(!__atomic_compare_exchange_n(word, &old.word[1], new.word[1], 1,
+	                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+/* Each process that allocates from the heap gets one of these.  "remoteFree"
+ * is the head of its Remote Free Queue. */
+typedef struct procSlot {
+	pid_t pid;
+	ShmOffset remoteFree;
+} ProcSlot;
+
+/* There is exactly one of these data structures per heap.  It sits at the
+ * start of the first chunk of memory that was passed to shmHeapInit(), and it
+ * holds everything we need to find our way around the heap. */
+typedef struct privateData {
+	/* SHM_HEAP_MAGIC once the heap has been initialized.  shmHeapAttach()
+	 * looks for it. */
+	uint32_t magic;
+
+	/* The SHM_HEAP_VERSION and sizeof(privateData) of the code that set
+	 * the heap up.  Nobody attaches to a heap with a different layout. */
+	uint32_t version;
+	uint32_t headerSize;
+
+	/* "dirty" is 1 while somebody holds the lock.  If it's already set
+	 * when the lock is taken, the last holder died partway through an
+	 * update, and "damaged" is set until the Size Index is rebuilt.  That
+	 * happens right away (see shmHeapLock()), and nothing can be allocated
+	 * while "damaged" is set.  See the Persistent Heaps section. */
+	uint32_t dirty;
+	uint32_t damaged;
+
+	/* The number of processes that opened the heap with shmHeapOpen() and
+	 * haven't detached from it yet.  If it isn't 0 when somebody opens the
+	 * heap alone, a process went away without detaching, and there may be
+	 * chunks stuck in its Thread Caches. */
+	uint32_t users;
+
+	/* The offset of whatever shmHeapSetRoot() was given, or 0. */
+	ShmOffset userRoot;
+
+	/* This protects everything below it, as well as the headers of the
+	 * free chunks. */
+	pthread_mutex_t lock;
+
+	/* How many times the lock was taken, how many of those times somebody
+	 * else already had it, and how long we waited in total.  These are
+	 * only updated while holding the lock. */
+	uint64_t lockAcquired;
+	uint64_t lockContended;
+	uint64_t lockWaitNs;
+
+	/* These are updated with atomic adds.  The Thread Cache updates them
+	 * without holding the lock. */
+	uint64_t counterFree;
+	uint64_t bytesFree;
+	uint64_t counterMalloc;
+	uint64_t bytesMalloc;
+
+	/* The rest of what shmHeapGetStats() reports.  "peakInUse",
+	 * "mallocFailed" and "mallocClasses" are updated with atomic adds like
+	 * the counters above.  The free chunk numbers are kept by the Size
+	 * Index, under the lock, but they're stored atomically so they can be
+	 * read without it.  "largestFree" is the size of the biggest free
+	 * chunk. */
+	uint64_t peakInUse;
+	uint64_t mallocFailed;
+	uint64_t mallocClasses[SHM_HEAP_STATS_CLASSES];
+	uint64_t freeChunkBytes;
+	uint64_t freeChunks;
+	uint64_t freeClasses[SHM_HEAP_STATS_CLASSES];
+	uint64_t largestFree;
+
+	/* The Trace Ring, if the heap was created with one.  "traceRing" is
+	 * the offset of an array of "traceMask" + 1 records.  Writers claim
+	 * records by bumping "traceHead"; the reader's position is
+	 * "traceTail". */
+	ShmOffset traceRing;
+	uint64_t traceMask;
+	uint64_t traceHead;
+	uint64_t traceTail;
+
+	/* Every pointer shmHeapMalloc() hands out is aligned to this many
+	 * bytes.  It's at least SHM_HEAP_ALIGN. */
+	size_t minAlign;
+
+	/* The Placement Policy (one of the SHM_HEAP_FIT_* values), and how
+	 * close a good fit has to be, in percent.  "fitRover" is the offset
+	 * where the last next fit search left off. */
+	uint32_t fitPolicy;
+	uint32_t fitPercent;
+	ShmOffset fitRover;
+
+	/* A chunk is only split if the piece left over would have at least
+	 * this many bytes of data.  It's at least SHM_HEAP_MIN_SIZE. */
+	size_t minSplit;
+
+	/* Heaps made by shmHeapCreate() can grow.  "heapSize" is how many
+	 * bytes (starting at the privateData header) are in use now, and
+	 * "maxSize" is how far they can go.  "maxSize" is 0 for heaps that
+	 * were handed to shmHeapInit(), and "heapSize" only covers the first
+	 * region they were given. */
+	size_t heapSize;
+	size_t maxSize;
+
+	/* CPU Arenas.  A heap made with ShmHeapOptions.cpuArenas is cut into
+	 * "cpuArenas" parts, "cpuArenaStride" bytes apart, and each part is a
+	 * heap of its own with its own privateData.  "cpuArenaIndex" says
+	 * which part this is.  "cpuArenas" is 0 if the heap isn't split. */
+	uint32_t cpuArenas;
+	uint32_t cpuArenaIndex;
+	size_t cpuArenaStride;
+
+	/* Page Purging.  Free chunks of at least "purgeThreshold" bytes have
+	 * their pages given back to the OS once they've been free for
+	 * "purgeDecay" milliseconds.  "bytesPurged" is how much of the free
+	 * memory is currently given back. */
+	size_t purgeThreshold;
+	uint64_t purgeDecay;
+
+	/* SHM_HEAP_HUGE_PAGE if the heap is backed by huge pages, otherwise
+	 * 0.  Large chunks are carved on huge page boundaries, and purging
+	 * works in whole huge pages. */
+	size_t hugePageSize;
+	uint64_t nextPurge;
+	uint64_t bytesPurged;
+
+	/* The root of the Size Tree. */
+	ShmOffset sizeTreeRoot;
+
+	/* The Size Bins. */
+	uint32_t binFlBitmap;
+	uint32_t binSlBitmap[SHM_HEAP_FL_COUNT];
+	ShmOffset binHeads[SHM_HEAP_FL_COUNT][SHM_HEAP_SL_COUNT];
+
+	/* The Quick Lists.  "quickLimit" is 0 if every chunk is coalesced as
+	 * soon as it's freed.  The heads and "quickBytes" are updated with
+	 * atomics, not under the lock. */
+	size_t quickLimit;
+	uint64_t quickBytes;
+	ShmOffset quickHeads[SHM_HEAP_QUICK_BINS];
+
+	/* The processes using the heap.  These are updated with atomics, not
+	 * under the lock. */
+	ProcSlot procSlots[SHM_HEAP_MAX_PROCS];
+} privateData;
+
+/* What this process knows about one heap.  The heap itself is shared, but
+ * where it's mapped, the file descriptor it was mapped from, and the ProcSlot
+ * we claimed in it belong to this process.  A ShmHeap handle points at one of
+ * these. */
+struct shmHeap {
+	/* The heap's header, or NULL if this entry isn't being used. */
+	privateData *pd;
+
+	/* The addresses the heap covers in this process.  shmHeapFree() uses
+	 * them to find the heap that a chunk came from. */
+	uintptr_t low;
+	uintptr_t high;
+
+	/* If we mapped the heap ourselves (shmHeapCreate() and friends), how
+	 * much we mapped and the descriptor.  "mapSize" is 0 otherwise.  A
+	 * process that didn't map the heap can use it, but can't make it
+	 * bigger. */
+	size_t mapSize;
+	int mapFd;
+
+	/* The ProcSlot this process claimed in the heap, once "slotClaimed" is
+	 * set.  -1 means every slot was taken. */
+	int slot;
+	int slotClaimed;
+
+	/* 1 if this process is counted in the heap's "users". */
+	int user;
+
+	/* If the heap is split into CPU Arenas, how many parts there are, how
+	 * far apart they are, and the entry for each part.  "cpu[0]" is this
+	 * entry.  The other parts have entries of their own with a "root"
+	 * that points back here, and no address range. */
+	int cpuCount;
+	size_t cpuStride;
+	ShmHeap *cpu[SHM_HEAP_MAX_CPU_ARENAS];
+	ShmHeap *root;
+};
+
+/* The most heaps one process can use at once.  Each CPU Arena counts. */
+#define SHM_HEAP_MAX_ARENAS   256
+
+/* Every heap this process is using.  Entry 0 is the default heap, which is the
+ * one that shmHeapInit(), shmHeapMalloc() and the rest of the original API
+ * work on.  Entries are only added or removed under "arenaLock". */
+static ShmHeap arenas[SHM_HEAP_MAX_ARENAS];
+static int arenaCount = 1;
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define defaultHeap (&arenas[0])
+#define privData    (arenas[0].pd)
+
+/* The number of parts "h" has.  It's 1 unless "h" is split into CPU
+ * Arenas. */
+static int arenaParts(ShmHeap *h)
+{
+	return (h->cpuCount > 1) ? h->cpuCount : 1;
+}
+
+/* Part "i" of "h". */
+static ShmHeap *arenaPart(ShmHeap *h, int i)
+{
+	return (h->cpuCount > 1) ? h->cpu[i] : h;
+}
+
+/* The heap that "h" is a part of, or "h" itself if it's not a CPU Arena. */
+static ShmHeap *arenaRoot(ShmHeap *h)
+{
+	return (h->root) ? h->root : h;
+}
+
+/* If "h" is split into CPU Arenas, find the part that "ptr" is in. */
+static ShmHeap *arenaPartOf(ShmHeap *h, const void *ptr)
+{
+	if(h->cpuCount > 1) {
+		return h->cpu[((uintptr_t) ptr - h->low) / h->cpuStride];
+	}
+	return h;
+}
+
+/* Find the heap that "ptr" came from.  Anything that isn't in one of the
+ * arenas belongs to the default heap, which can be made of more than one
+ * piece of memory. */
+static ShmHeap *arenaOf(const void *ptr)
+{
+	int count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+	int i;
+
+	for(i = 1; i < count; i++) {
+		ShmHeap *h = &arenas[i];
+		if((uintptr_t) ptr >= h->low && (uintptr_t) ptr < h->high) {
+			return arenaPartOf(h, ptr);
+		}
+	}
+
+	/* More memory can be added to the default heap after it's split, and
+	 * all of that belongs to its first part. */
+	if((uintptr_t) ptr >= defaultHeap->low && (uintptr_t) ptr < defaultHeap->high) {
+		return arenaPartOf(defaultHeap, ptr);
+	}
+	return defaultHeap;
+}
+
+/* Convert an offset into a pointer in this process. */
+static void *shmHeapPtr(privateData *pd, ShmOffset off)
+{
+	return off ? (void *) ((unsigned char *) pd + off) : NULL;
+}
+
+/* Convert a pointer in this process into an offset. */
+static ShmOffset shmHeapOff(privateData *pd, const void *ptr)
+{
+	return ptr ? (ShmOffset) ((const unsigned char *) ptr - (const unsigned char *) pd) : 0;
+}
+
+/* Bump one of the privateData counters. */
+#define shmHeapCount(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/* Set one of the counters that only the lock holder changes.  Nobody else
+ * writes it, so there's no need for an atomic add, but it's still stored
+ * atomically for shmHeapGetStats(), which reads it without the lock. */
+#define shmHeapCountSet(counter, n) __atomic_store_n(&(counter), (n), __ATOMIC_RELAXED)
+
+/* The statistics size class of "size": class 0 is everything under 32 bytes,
+ * then one class per power of 2, and the last class holds everything else. */
+static int shmHeapStatsClass(size_t size)
+{
+	if(size < 32) {
+		return 0;
+	}
+	int cls = (int) (sizeof(size) * 8) - 1 - __builtin_clzl(size) - 4;
+	return (cls < SHM_HEAP_STATS_CLASSES) ? cls : SHM_HEAP_STATS_CLASSES - 1;
+}
+
+/* Count "bytes" more as handed out, and raise the high-water mark if we've
+ * passed it. */
+static void shmHeapCountMalloc(privateData *pd, uint64_t bytes)
+{
+	uint64_t inUse = shmHeapCount(pd->bytesMalloc, bytes) + bytes -
+	                 __atomic_load_n(&pd->bytesFree, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&pd->peakInUse, __ATOMIC_RELAXED);
+	while((int64_t) inUse > (int64_t) peak &&
+	      !__atomic_compare_exchange_n(&pd->peakInUse, &peak, inUse, 1,
+	                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/* The biggest request we'll take.  A chunk's size has to fit in the 48 bits
+ * of AllocStruct.size, and rounding it (or adding a header to it) must not
+ * wrap around. */
+#define SHM_HEAP_MAX_SIZE \
+	((((uint64_t) 1 << 48) - 1 < (uint64_t) SIZE_MAX - SHM_HEAP_ALIGN) ? \
+	 (size_t) ((((uint64_t) 1 << 48) - 1) & ~((uint64_t) SHM_HEAP_ALIGN - 1)) : \
+	 (SIZE_MAX - SHM_HEAP_ALIGN) & ~((size_t) SHM_HEAP_ALIGN - 1))
+
+/* Round a request up to a whole number of SHM_HEAP_ALIGN units.  Every chunk
+ * is sized this way.  That keeps all of the headers (and the data behind
+ * them) aligned, and it's what the Size Bins are built around.  The caller
+ * has already made sure "size" is no more than SHM_HEAP_MAX_SIZE. */
+static size_t shmHeapRoundSize(size_t size)
+{
+	if(size < SHM_HEAP_MIN_SIZE) {
+		return SHM_HEAP_MIN_SIZE;
+	}
+	return (size + SHM_HEAP_ALIGN - 1) & ~((size_t) SHM_HEAP_ALIGN - 1);
+}
+
+/* Shorthand for following and storing SizeTree links.  "pd" has to be in
+ * scope. */
+#define NODE(off) ((SizeTree *) shmHeapPtr(pd, (off)))
+#define OFF(ptr)  shmHeapOff(pd, (ptr))
+
+/* Get the chunk that a SizeTree node is embedded in. */
+static AllocStruct *sizeTreeChunk(SizeTree *node)
+{
+	return chunkFromData(node);
+}
+
+static void _shmHeapFree(privateData *pd, void *ptr, int external);
+static void chunkSplit(privateData *pd, AllocStruct *curr, size_t size);
+static void chunkRelease(privateData *pd, AllocStruct *curr);
+static size_t purgeRange(privateData *pd, AllocStruct *curr, unsigned char **start);
+static void *quickMalloc(privateData *pd, size_t size);
+static size_t quickConsolidate(privateData *pd);
+static int heapRecover(privateData *pd, int live);
+static void shmHeapProcessInit(void);
+static void arenaInit(ShmHeap *h, unsigned char *heap, size_t size, const ShmHeapOptions *opts);
+static void arenaDetach(ShmHeap *h);
+static int arenaCreate(ShmHeap *h, const char *name, int file, size_t initial, size_t max,
+                       const ShmHeapOptions *opts);
+static int arenaAttachName(ShmHeap *h, const char *name);
+static int arenaAttachFd(ShmHeap *h, int fd, const char *name);
+static int arenaOpen(ShmHeap *h, const char *path, size_t initial, size_t max, const ShmHeapOptions *opts);
+static ShmHeap *arenaNew(void);
+static void cpuArenasDetach(ShmHeap *h);
+
+static pthread_once_t processOnce = PTHREAD_ONCE_INIT;
+
+/* How many Size Tree nodes this thread has visited since the current call
+ * started.  It goes into the Trace Ring. */
+static __thread unsigned int traceDepth;
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Size Tree.
+ ******************************************************************************
+ ******************************************************************************/
+
+/* Find the smallest node in "tree" that holds at least "size" bytes.  We're
+ * essentially looking for either an exact match or the successor to an exact
+ * match.  Returns NULL if every node is smaller.
+ */
+static SizeTree *sizeTreeLowest(privateData *pd, SizeTree *tree, size_t size)
+{
+	SizeTree *node = NULL;
+
+	while(tree) {
+		traceDepth++;
+
+		/* If the current value is too small, look for something larger. */
+		if(tree->size < size) {
+			tree = NODE(tree->right);
+		}
+
+		/* This size will work.  Save it and look down the left side for
+		 * a better match. */
+		else {
+			node = tree;
+			tree = NODE(tree->left);
+		}
+	}
+
+	return node;
+}
+
+/* The node that follows "node" in size order, or NULL if it's the biggest.
+ * This climbs the parent links instead of recursing, the same way insert and
+ * delete do. */
+static SizeTree *sizeTreeSuccessor(privateData *pd, SizeTree *node)
+{
+	if(node->right) {
+		node = NODE(node->right);
+		while(node->left) {
+			node = NODE(node->left);
+		}
+		return node;
+	}
+
+	SizeTree *parent = NODE(node->parent);
+	while(parent && OFF(node) == parent->right) {
+		node = parent;
+		parent = NODE(node->parent);
+	}
+	return parent;
+}
+
+/* Traverse the tree (tree-verse (HAHA)) that "root" is the root of, in size
+ * order. */
+static void sizeTreeTraverse(privateData *pd, SizeTree *root)
+{
+	SizeTree *tree;
+
+	for(tree = sizeTreeLowest(pd, root, 0); tree; tree = sizeTreeSuccessor(pd, tree)) {
+		fprintf(stderr, "size %ld: ptr ( ", tree->size);
+		SizeTree *node = tree;
+		while(node) {
+			fprintf(stderr, "%p ", sizeTreeChunk(node));
+			node = NODE(node->next);
+		}
+		fprintf(stderr, ")\n");
+	}
+}
+
+/* Locate an entry of "size" bytes (or slightly larger) from "tree".  If the
+ * node has other chunks on its list, return one of those instead.  They can
+ * be unlinked without touching the tree.
+ */
+static SizeTree *sizeTreeFindNode(privateData *pd, SizeTree *tree, size_t size)
+{
+	SizeTree *node = sizeTreeLowest(pd, tree, size);
+
+	if(node && node->next) {
+		node = NODE(node->next);
+	}
+
+	return node;
+}
+
+static int sizeTreeIsRed(privateData *pd, ShmOffset off)
+{
+	return off && NODE(off)->red;
+}
+
+/* Point whatever referenced "oldNode" (its parent, or the root) at "newNode". */
+static void sizeTreeReplaceChild(privateData *pd, ShmOffset *root, SizeTree *parent,
+                                 SizeTree *oldNode, SizeTree *newNode)
+{
+	if(parent == NULL) {
+		*root = OFF(newNode);
+	}
+	else if(parent->left == OFF(oldNode)) {
+		parent->left = OFF(newNode);
+	}
+	else {
+		parent->right = OFF(newNode);
+	}
+}
+
+static void sizeTreeRotateLeft(privateData *pd, ShmOffset *root, SizeTree *node)
+{
+	SizeTree *right = NODE(node->right);
+
+	node->right = right->left;
+	if(right->left) {
+		NODE(right->left)->parent = OFF(node);
+	}
+
+	right->parent = node->parent;
+	sizeTreeReplaceChild(pd, root, NODE(node->parent), node, right);
+
+	right->left = OFF(node);
+	node->parent = OFF(right);
+}
+
+static void sizeTreeRotateRight(privateData *pd, ShmOffset *root, SizeTree *node)
+{
+	SizeTree *left = NODE(node->left);
+
+	node->left = left->right;
+	if(left->right) {
+		NODE(left->right)->parent = OFF(node);
+	}
+
+	left->parent = node->parent;
+	sizeTreeReplaceChild(pd, root, NODE(node->parent), node, left);
+
+	left->right = OFF(node);
+	node->parent = OFF(left);
+}
+
+/* Insert "node" into "tree". */
+static void sizeTreeInsertNode(privateData *pd, ShmOffset *root, SizeTree *node)
+{
+	SizeTree *parent = NULL;
+	SizeTree *tree = NODE(*root);
+
+	node->left = node->right = node->parent = 0;
+	node->next = node->prev = 0;
+
+	while(tree) {
+		traceDepth++;
+
+		/* There's already a node for this size.  Put "node" on its list.
+		 * The tree doesn't change. */
+		if(tree->size == node->size) {
+			node->prev = OFF(tree);
+			node->next = tree->next;
+			if(tree->next) {
+				NODE(tree->next)->prev = OFF(node);
+			}
+			tree->next = OFF(node);
+			return;
+		}
+
+		parent = tree;
+		tree = NODE((node->size < tree->size) ? tree->left : tree->right);
+	}
+
+	node->parent = OFF(parent);
+	node->red = 1;
+	if(parent == NULL) {
+		*root = OFF(node);
+	}
+	else if(node->size < parent->size) {
+		parent->left = OFF(node);
+	}
+	else {
+		parent->right = OFF(node);
+	}
+
+	/* Rebalance.  A red node can't have a red parent. */
+	while((parent = NODE(node->parent)) && parent->red) {
+		SizeTree *grand = NODE(parent->parent);
+
+		if(OFF(parent) == grand->left) {
+			SizeTree *uncle = NODE(grand->right);
+			if(uncle && uncle->red) {
+				parent->red = uncle->red = 0;
+				grand->red = 1;
+				node = grand;
+				continue;
+			}
+			if(OFF(node) == parent->right) {
+				sizeTreeRotateLeft(pd, root, parent);
+				node = parent;
+				parent = NODE(node->parent);
+			}
+			parent->red = 0;
+			grand->red = 1;
+			sizeTreeRotateRight(pd, root, grand);
+		}
+		else {
+			SizeTree *uncle = NODE(grand->left);
+			if(uncle && uncle->red) {
+				parent->red = uncle->red = 0;
+				grand->red = 1;
+				node = grand;
+				continue;
+			}
+			if(OFF(node) == parent->left) {
+				sizeTreeRotateRight(pd, root, parent);
+				node = parent;
+				parent = NODE(node->parent);
+			}
+			parent->red = 0;
+			grand->red = 1;
+			sizeTreeRotateLeft(pd, root, grand);
+		}
+	}
+
+	NODE(*root)->red = 0;
+}
+
+/* Restore the red-black properties after a black node was removed from
+ * underneath "parent".  "node" is the (possibly NULL) child that took its
+ * place. */
+static void sizeTreeRemoveFixup(privateData *pd, ShmOffset *root, SizeTree *node, SizeTree *parent)
+{
+	SizeTree *sibling;
+
+	while((node == NULL || !node->red) && OFF(node) != *root) {
+		if(parent->left == OFF(node)) {
+			sibling = NODE(parent->right);
+			if(sibling->red) {
+				sibling->red = 0;
+				parent->red = 1;
+				sizeTreeRotateLeft(pd, root, parent);
+				sibling = NODE(parent->right);
+			}
+			if(!sizeTreeIsRed(pd, sibling->left) && !sizeTreeIsRed(pd, sibling->right)) {
+				sibling->red = 1;
+				node = parent;
+				parent = NODE(node->parent);
+			}
+			else {
+				if(!sizeTreeIsRed(pd, sibling->right)) {
+					NODE(sibling->left)->red = 0;
+					sibling->red = 1;
+					sizeTreeRotateRight(pd, root, sibling);
+					sibling = NODE(parent->right);
+				}
+				sibling->red = parent->red;
+				parent->red = 0;
+				if(sibling->right) {
+					NODE(sibling->right)->red = 0;
+				}
+				sizeTreeRotateLeft(pd, root, parent);
+				node = NODE(*root);
+				break;
+			}
+		}
+		else {
+			sibling = NODE(parent->left);
+			if(sibling->red) {
+				sibling->red = 0;
+				parent->red = 1;
+				sizeTreeRotateRight(pd, root, parent);
+				sibling = NODE(parent->left);
+			}
+			if(!sizeTreeIsRed(pd, sibling->left) && !sizeTreeIsRed(pd, sibling->right)) {
+				sibling->red = 1;
+				node = parent;
+				parent = NODE(node->parent);
+			}
+			else {
+				if(!sizeTreeIsRed(pd, sibling->left)) {
+					NODE(sibling->right)->red = 0;
+					sibling->red = 1;
+					sizeTreeRotateLeft(pd, root, sibling);
+					sibling = NODE(parent->left);
+				}
+				sibling->red = parent->red;
+				parent->red = 0;
+				if(sibling->left) {
+					NODE(sibling->left)->red = 0;
+				}
+				sizeTreeRotateRight(pd, root, parent);
+				node = NODE(*root);
+				break;
+			}
+		}
+	}
+
+	if(node) {
+		node->red = 0;
+	}
+}
+
+/* Remove "node" from "tree".  Returns 1 on success, or 0 if "node" isn't
+ * in the tree. */
+static int sizeTreeRemoveNode(privateData *pd, ShmOffset *root, SizeTree *node)
+{
+	/* If our "node" is on the "list" for its size, just unlink it from
+	 * the list.  The tree doesn't change. */
+	if(node->prev) {
+		NODE(node->prev)->next = node->next;
+		if(node->next) {
+			NODE(node->next)->prev = node->prev;
+		}
+		node->next = node->prev = 0;
+		return 1;
+	}
+
+	/* Anything else has to be linked into the tree. */
+	if(node->parent == 0 && *root != OFF(node)) {
+		return 0;
+	}
+
+	/* There are other nodes of the same size.  Just promote one of them
+	 * up so it takes over this node's spot in the tree. */
+	if(node->next) {
+		SizeTree *promote = NODE(node->next);
+		promote->prev = 0;
+		promote->left = node->left;
+		promote->right = node->right;
+		promote->parent = node->parent;
+		promote->red = node->red;
+		if(promote->left) {
+			NODE(promote->left)->parent = OFF(promote);
+		}
+		if(promote->right) {
+			NODE(promote->right)->parent = OFF(promote);
+		}
+		sizeTreeReplaceChild(pd, root, NODE(node->parent), node, promote);
+	}
+	else {
+		SizeTree *child, *parent;
+		int red;
+
+		if(node->left && node->right) {
+			/* There are left and right entries.  Swap in the
+			 * successor (the left-most node on the right side). */
+			SizeTree *succ = NODE(node->right);
+			while(succ->left) {
+				succ = NODE(succ->left);
+			}
+
+			child = NODE(succ->right);
+			parent = NODE(succ->parent);
+			red = succ->red;
+
+			if(child) {
+				child->parent = OFF(parent);
+			}
+			if(parent == node) {
+				parent->right = OFF(child);
+				parent = succ;
+			}
+			else {
+				parent->left = OFF(child);
+			}
+
+			succ->parent = node->parent;
+			succ->red = node->red;
+			succ->left = node->left;
+			succ->right = node->right;
+			sizeTreeReplaceChild(pd, root, NODE(node->parent), node, succ);
+
+			NODE(succ->left)->parent = OFF(succ);
+			if(succ->right) {
+				NODE(succ->right)->parent = OFF(succ);
+			}
+		}
+		else {
+			/* At most one side is populated.  Promote it up one
+			 * level.  Note that it might be empty. */
+			child = NODE(node->left ? node->left : node->right);
+			parent = NODE(node->parent);
+			red = node->red;
+
+			if(child) {
+				child->parent = OFF(parent);
+			}
+			sizeTreeReplaceChild(pd, root, parent, node, child);
+		}
+
+		if(!red) {
+			sizeTreeRemoveFixup(pd, root, child, parent);
+		}
+	}
+
+	node->left = node->right = node->parent = 0;
+	node->next = 0;
+	return 1;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Size Bins.
+ ******************************************************************************
+ ******************************************************************************/
+/* Free chunks smaller than SHM_HEAP_LARGE_SIZE don't go into the Size Tree.
+ * They go into a two-level segregated array of lists (the same idea as TLSF).
+ * The first level is a power-of-two size class.  The second level splits each
+ * class into SHM_HEAP_SL_COUNT linear subdivisions.  A bitmap at each level
+ * tells us which lists have something on them, so finding a chunk is a couple
+ * of find-first-set instructions instead of a search.
+ *
+ * The lists are doubly linked through the "next" and "prev" members of the
+ * chunk's SizeTree node.  The head of each list has a NULL "prev". */
+
+/* Index of the most significant bit that is set in "size". */
+static int binFls(size_t size)
+{
+	return (int) (sizeof(size) * 8) - 1 - __builtin_clzl(size);
+}
+
+/* Calculate the list that a chunk of "size" bytes is stored on. */
+static void binMapping(size_t size, int *fl, int *sl)
+{
+	if(size < SHM_HEAP_SMALL_SIZE) {
+		*fl = 0;
+		*sl = (int) (size >> SHM_HEAP_ALIGN_LOG2);
+	}
+	else {
+		int bit = binFls(size);
+		*sl = (int) (size >> (bit - SHM_HEAP_SL_LOG2)) & (SHM_HEAP_SL_COUNT - 1);
+		*fl = bit - SHM_HEAP_FL_SHIFT + 1;
+	}
+}
+
+/* Traverse the bins. */
+static void binTraverse(privateData *pd)
+{
+	int fl, sl;
+	for(fl = 0; fl < SHM_HEAP_FL_COUNT; fl++) {
+		for(sl = 0; sl < SHM_HEAP_SL_COUNT; sl++) {
+			SizeTree *node = NODE(pd->binHeads[fl][sl]);
+			if(node == NULL) {
+				continue;
+			}
+
+			fprintf(stderr, "bin %d/%d: ptr ( ", fl, sl);
+			while(node) {
+				fprintf(stderr, "%p(%ld) ", sizeTreeChunk(node), (long) sizeTreeChunk(node)->size);
+				node = NODE(node->next);
+			}
+			fprintf(stderr, ")\n");
+		}
+	}
+}
+
+/* Locate a list that is guaranteed to only hold chunks of at least "size"
+ * bytes, and return the first chunk on it.  Returns NULL if there is no such
+ * chunk in the bins.  Sizes that round up past the last bin aren't handled
+ * here; they belong to the Size Tree.
+ */
+static SizeTree *binFindNode(privateData *pd, size_t size)
+{
+	int fl, sl;
+
+	/* Round up to the start of the next list, so that every chunk on the
+	 * list we pick is big enough. */
+	if(size >= SHM_HEAP_SMALL_SIZE) {
+		size += ((size_t) 1 << (binFls(size) - SHM_HEAP_SL_LOG2)) - 1;
+	}
+	if(size >= SHM_HEAP_LARGE_SIZE) {
+		return NULL;
+	}
+	binMapping(size, &fl, &sl);
+
+	uint32_t slMap = pd->binSlBitmap[fl] & (~0U << sl);
+	if(slMap == 0) {
+		uint32_t flMap = pd->binFlBitmap & (~0U << (fl + 1));
+		if(flMap == 0) {
+			return NULL;
+		}
+		fl = __builtin_ctz(flMap);
+		slMap = pd->binSlBitmap[fl];
+	}
+	sl = __builtin_ctz(slMap);
+
+	return NODE(pd->binHeads[fl][sl]);
+}
+
+/* Push "node" on the front of its list. */
+static void binInsertNode(privateData *pd, SizeTree *node)
+{
+	int fl, sl;
+	binMapping(sizeTreeChunk(node)->size, &fl, &sl);
+
+	node->prev = 0;
+	node->next = pd->binHeads[fl][sl];
+	if(node->next) {
+		NODE(node->next)->prev = OFF(node);
+	}
+	pd->binHeads[fl][sl] = OFF(node);
+
+	pd->binFlBitmap |= 1U << fl;
+	pd->binSlBitmap[fl] |= 1U << sl;
+}
+
+/* Unlink "node" from its list.  Returns 1 on success, or 0 if "node" isn't
+ * on a list. */
+static int binRemoveNode(privateData *pd, SizeTree *node)
+{
+	int fl, sl;
+	binMapping(sizeTreeChunk(node)->size, &fl, &sl);
+
+	if(node->prev) {
+		NODE(node->prev)->next = node->next;
+	}
+	else if(pd->binHeads[fl][sl] == OFF(node)) {
+		pd->binHeads[fl][sl] = node->next;
+		if(node->next == 0) {
+			pd->binSlBitmap[fl] &= ~(1U << sl);
+			if(pd->binSlBitmap[fl] == 0) {
+				pd->binFlBitmap &= ~(1U << fl);
+			}
+		}
+	}
+	else {
+		return 0;
+	}
+
+	if(node->next) {
+		NODE(node->next)->prev = node->prev;
+	}
+	node->next = node->prev = 0;
+	return 1;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the Size Index.  It sends each free chunk to the Size Bins or the
+ **** Size Tree, depending on how big it is.
+ ******************************************************************************
+ ******************************************************************************/
+/* Find a free chunk of at least "size" bytes.  Small requests are served from
+ * the bins in constant time.  The Size Tree is only searched when the request
+ * is large, or when the bins have nothing big enough. */
+static SizeTree *sizeIndexFindNode(privateData *pd, size_t size)
+{
+	SizeTree *node = NULL;
+
+	if(size < SHM_HEAP_LARGE_SIZE) {
+		node = binFindNode(pd, size);
+	}
+	if(node == NULL) {
+		node = sizeTreeFindNode(pd, NODE(pd->sizeTreeRoot), size);
+	}
+
+	return node;
+}
+
+/* Return the size of the biggest free chunk.  That's the rightmost node of
+ * the Size Tree, or if the tree is empty, the biggest chunk on the highest
+ * list in the Size Bins.  Only one list is searched, and chunks on the same
+ * list are within 1/SHM_HEAP_SL_COUNT of each other's size.  This is only
+ * called when the biggest free chunk leaves the Size Index. */
+static size_t sizeIndexLargest(privateData *pd)
+{
+	SizeTree *node = NODE(pd->sizeTreeRoot);
+	if(node) {
+		while(node->right) {
+			node = NODE(node->right);
+		}
+		return node->size;
+	}
+
+	if(pd->binFlBitmap == 0) {
+		return 0;
+	}
+	int fl = binFls(pd->binFlBitmap);
+	int sl = binFls(pd->binSlBitmap[fl]);
+
+	size_t largest = 0;
+	for(node = NODE(pd->binHeads[fl][sl]); node; node = NODE(node->next)) {
+		if(sizeTreeChunk(node)->size > largest) {
+			largest = sizeTreeChunk(node)->size;
+		}
+	}
+	return largest;
+}
+
+static void sizeIndexInsertNode(privateData *pd, SizeTree *node)
+{
+	size_t size = sizeTreeChunk(node)->size;
+
+	shmHeapCountSet(pd->freeChunkBytes, pd->freeChunkBytes + size);
+	shmHeapCountSet(pd->freeChunks, pd->freeChunks + 1);
+	shmHeapCountSet(pd->freeClasses[shmHeapStatsClass(size)],
+	                pd->freeClasses[shmHeapStatsClass(size)] + 1);
+	if(size > pd->largestFree) {
+		shmHeapCountSet(pd->largestFree, size);
+	}
+
+	if(size < SHM_HEAP_LARGE_SIZE) {
+		binInsertNode(pd, node);
+	}
+	else {
+		node->size = size;
+		sizeTreeInsertNode(pd, &pd->sizeTreeRoot, node);
+	}
+}
+
+static int sizeIndexRemoveNode(privateData *pd, SizeTree *node)
+{
+	/* Whoever is taking the chunk is about to touch its pages again. */
+	AllocStruct *curr = sizeTreeChunk(node);
+	if(curr->purged) {
+		shmHeapCountSet(pd->bytesPurged, pd->bytesPurged - purgeRange(pd, curr, NULL));
+		curr->purged = 0;
+	}
+
+	size_t size = curr->size;
+	int success = (size < SHM_HEAP_LARGE_SIZE) ? binRemoveNode(pd, node) :
+	              sizeTreeRemoveNode(pd, &pd->sizeTreeRoot, node);
+	if(success) {
+		shmHeapCountSet(pd->freeChunkBytes, pd->freeChunkBytes - size);
+		shmHeapCountSet(pd->freeChunks, pd->freeChunks - 1);
+		shmHeapCountSet(pd->freeClasses[shmHeapStatsClass(size)],
+		                pd->freeClasses[shmHeapStatsClass(size)] - 1);
+		if(size == pd->largestFree) {
+			shmHeapCountSet(pd->largestFree, sizeIndexLargest(pd));
+		}
+	}
+	return success;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Placement Policies.
+ ******************************************************************************
+ ******************************************************************************/
+/* The Size Index normally does a good fit: it rounds the size up to the next
+ * Size Bin, so that any chunk on that list will do, and takes the first one.
+ * That's fast, but it can pass over a chunk that would have been a better
+ * fit.  A heap can be set up to pick chunks differently:
+ *
+ * - SHM_HEAP_FIT_GOOD with a "fitPercent" first looks at the head of the list
+ *   that the size itself falls in, and takes it if it's big enough and no
+ *   more than "fitPercent" percent too big.
+ *
+ * - SHM_HEAP_FIT_BEST takes the smallest chunk that's big enough.
+ *
+ * - SHM_HEAP_FIT_FIRST takes the big enough chunk with the lowest address,
+ *   which tends to keep the heap packed toward its start.
+ *
+ * - SHM_HEAP_FIT_NEXT takes the first big enough chunk at or after the place
+ *   where the last search left off, wrapping around at the end.
+ *
+ * The lists aren't kept in address order, so first and next fit look at
+ * every free chunk that's big enough.  Best fit stops at the first Size Bin
+ * list that has a chunk that fits, but it looks at everything on that list.
+ * The time a malloc takes with these grows with the number of free chunks.
+ */
+
+/* How well "node" fits for "policy".  Lower is better. */
+static uint64_t fitKey(privateData *pd, SizeTree *node, int policy)
+{
+	AllocStruct *curr = sizeTreeChunk(node);
+
+	switch(policy) {
+	case SHM_HEAP_FIT_BEST:  return curr->size;
+	case SHM_HEAP_FIT_FIRST: return (uint64_t) OFF(curr);
+	default:                 return (uint64_t) (OFF(curr) - pd->fitRover);
+	}
+}
+
+/* Look at the chunks on the list that starts at "node", and remember the best
+ * one that's at least "size" bytes. */
+static void fitScanList(privateData *pd, SizeTree *node, size_t size, int policy,
+                        SizeTree **best, uint64_t *bestKey)
+{
+	for(; node; node = NODE(node->next)) {
+		traceDepth++;
+
+		if(sizeTreeChunk(node)->size >= size) {
+			uint64_t key = fitKey(pd, node, policy);
+			if(key < *bestKey) {
+				*best = node;
+				*bestKey = key;
+			}
+		}
+	}
+}
+
+/* The same as fitScanList(), for every node in the Size Tree at "root" that's
+ * big enough. */
+static void fitScanTree(privateData *pd, SizeTree *root, size_t size, int policy,
+                        SizeTree **best, uint64_t *bestKey)
+{
+	SizeTree *tree;
+
+	for(tree = sizeTreeLowest(pd, root, size); tree; tree = sizeTreeSuccessor(pd, tree)) {
+		fitScanList(pd, tree, size, policy, best, bestKey);
+	}
+}
+
+/* Search for a chunk of at least "size" bytes with best, first or next fit. */
+static SizeTree *fitScan(privateData *pd, size_t size, int policy)
+{
+	SizeTree *best = NULL;
+	uint64_t bestKey = UINT64_MAX;
+	int fl, sl;
+
+	if(size < SHM_HEAP_LARGE_SIZE) {
+		binMapping(size, &fl, &sl);
+		for(; fl < SHM_HEAP_FL_COUNT; fl++, sl = 0) {
+			uint32_t slMap = pd->binSlBitmap[fl] & (~0U << sl);
+
+			while(slMap) {
+				sl = __builtin_ctz(slMap);
+				slMap &= slMap - 1;
+				fitScanList(pd, NODE(pd->binHeads[fl][sl]), size, policy, &best, &bestKey);
+
+				/* The lists go up in size, so the first one with
+				 * a chunk that fits has the best fit. */
+				if(best && policy == SHM_HEAP_FIT_BEST) {
+					return best;
+				}
+			}
+		}
+	}
+
+	/* The Size Tree's own search is already a best fit. */
+	if(policy == SHM_HEAP_FIT_BEST) {
+		best = sizeTreeFindNode(pd, NODE(pd->sizeTreeRoot), size);
+	}
+	else {
+		fitScanTree(pd, NODE(pd->sizeTreeRoot), size, policy, &best, &bestKey);
+	}
+
+	return best;
+}
+
+/* Find a free chunk of at least "size" bytes, the way the heap's Placement
+ * Policy says to.  Returns NULL if there isn't one. */
+static SizeTree *fitFindNode(privateData *pd, size_t size)
+{
+	SizeTree *node;
+	int fl, sl;
+
+	switch(pd->fitPolicy) {
+	case SHM_HEAP_FIT_BEST:
+	case SHM_HEAP_FIT_FIRST:
+		return fitScan(pd, size, pd->fitPolicy);
+
+	case SHM_HEAP_FIT_NEXT:
+		node = fitScan(pd, size, pd->fitPolicy);
+		if(node) {
+			pd->fitRover = OFF(sizeTreeChunk(node)) + AllocStructDataOffset + size;
+		}
+		return node;
+
+	default:
+		if(pd->fitPercent && size < SHM_HEAP_LARGE_SIZE) {
+			size_t slack = (pd->fitPercent > SIZE_MAX / size) ? SIZE_MAX :
+			               size * pd->fitPercent / 100;
+
+			binMapping(size, &fl, &sl);
+			node = NODE(pd->binHeads[fl][sl]);
+			if(node && sizeTreeChunk(node)->size >= size &&
+			   sizeTreeChunk(node)->size - size <= slack) {
+				return node;
+			}
+		}
+		return sizeIndexFindNode(pd, size);
+	}
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Heap Lock.
+ ******************************************************************************
+ ******************************************************************************/
+/* The lock is shared by every process that has the heap mapped.  It's robust,
+ * so if a process dies while it's holding the lock, the next process to ask
+ * for it gets it (with EOWNERDEAD) instead of waiting forever.  The Object
+ * Pools use the same kind of lock. */
+static void shmHeapMutexInit(pthread_mutex_t *lock)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Nanoseconds on a clock that every process agrees on. */
+static uint64_t shmHeapNowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Take "lock".  Returns how many nanoseconds we had to wait for it, or 0 if
+ * nobody else had it. */
+static uint64_t shmHeapMutexLock(pthread_mutex_t *lock)
+{
+	uint64_t waited = 0;
+
+	int rc = pthread_mutex_trylock(lock);
+	if(rc == EBUSY) {
+		uint64_t start = shmHeapNowNs();
+		rc = pthread_mutex_lock(lock);
+		waited = shmHeapNowNs() - start + 1;
+	}
+
+	if(rc == EOWNERDEAD) {
+		/* The previous owner died.  shmHeapLock() sees that "dirty"
+		 * is still set and repairs the heap. */
+		fprintf(stderr, "%s(): WARNING: Recovered a lock from a dead process.\n", __func__);
+		pthread_mutex_consistent(lock);
+	}
+	else if(rc != 0) {
+		fprintf(stderr, "%s(): ERROR: pthread_mutex_lock() returned %d.\n", __func__, rc);
+	}
+
+	return waited;
+}
+
+static void shmHeapMutexUnlock(pthread_mutex_t *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+static void shmHeapLockInit(privateData *pd)
+{
+	shmHeapMutexInit(&pd->lock);
+}
+
+static void shmHeapLock(privateData *pd)
+{
+	uint64_t waited = shmHeapMutexLock(&pd->lock);
+
+	pd->lockAcquired++;
+	if(waited) {
+		pd->lockContended++;
+		pd->lockWaitNs += waited;
+	}
+
+	/* The lock is only ever let go of with "dirty" cleared, so the last
+	 * holder died partway through an update.  Rebuild the Size Index before
+	 * anybody allocates from it.  If that can't be done, "damaged" stays set
+	 * and every allocation fails. */
+	if(pd->dirty) {
+		pd->damaged = 1;
+		fprintf(stderr, "%s(): WARNING: Rebuilding the heap after a process died holding its lock.\n", __func__);
+		if(heapRecover(pd, 1) != 0) {
+			fprintf(stderr, "%s(): ERROR: The heap is too badly damaged.  Allocations will fail.\n", __func__);
+		}
+	}
+	pd->dirty = 1;
+}
+
+static void shmHeapUnlock(privateData *pd)
+{
+	pd->dirty = 0;
+	shmHeapMutexUnlock(&pd->lock);
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of Page Purging.
+ ******************************************************************************
+ ******************************************************************************/
+/* A large free chunk keeps its pages resident even though nobody is using
+ * them.  Once such a chunk has been free for a while, we give the pages in
+ * its interior back to the OS.  Its header and SizeTree node stay where they
+ * are, so the chunk is still in the Size Index and can be coalesced as usual.
+ * If it's allocated again, the pages fault back in (as zeros).
+ *
+ * There is no background thread.  Whenever _shmHeapFree() produces a chunk
+ * that's big enough, it stamps the chunk with the time, and at most once per
+ * "purgeDecay" it walks the big free chunks and purges the ones that have
+ * been free for that long.  shmHeapTrim() purges everything right away.
+ *
+ * A purged chunk is marked "purged" and its pages are counted in
+ * "bytesPurged", so we know how much memory will have to fault back in.  The
+ * mark is cleared when the chunk leaves the Size Index.
+ */
+#define SHM_HEAP_PURGE_DEFAULT_THRESHOLD  SHM_HEAP_LARGE_SIZE
+#define SHM_HEAP_PURGE_DEFAULT_DECAY      1000
+
+/* The size of the pages that back the heap. */
+static size_t shmHeapPageSize(privateData *pd)
+{
+	return (pd->hugePageSize) ? pd->hugePageSize : (size_t) getpagesize();
+}
+
+/* Start treating the heap as backed by huge pages.  The purge threshold has
+ * to leave room for at least one whole huge page. */
+static void shmHeapSetHugePages(privateData *pd)
+{
+	pd->hugePageSize = SHM_HEAP_HUGE_PAGE;
+	if(pd->purgeThreshold < sizeof(SizeTree) + 2 * pd->hugePageSize) {
+		pd->purgeThreshold = sizeof(SizeTree) + 2 * pd->hugePageSize;
+	}
+}
+
+/* Ask for transparent huge pages over the part of [heap, heap + size) that
+ * covers whole huge pages.  Returns 0 on success. */
+static int shmHeapAdviseHuge(unsigned char *heap, size_t size)
+{
+	uintptr_t first = ((uintptr_t) heap + SHM_HEAP_HUGE_PAGE - 1) & ~((uintptr_t) SHM_HEAP_HUGE_PAGE - 1);
+	uintptr_t last = ((uintptr_t) heap + size) & ~((uintptr_t) SHM_HEAP_HUGE_PAGE - 1);
+
+	if(last <= first) {
+		errno = EINVAL;
+		return -1;
+	}
+	return madvise((void *) first, last - first, MADV_HUGEPAGE);
+}
+
+/* Milliseconds on a clock that every process agrees on. */
+static uint64_t shmHeapNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Return the number of bytes in the page-aligned interior of the free chunk
+ * "curr", and where it starts.  On a heap with huge pages, only whole huge
+ * pages are purged, so that none of them get split up. */
+static size_t purgeRange(privateData *pd, AllocStruct *curr, unsigned char **start)
+{
+	uintptr_t page = (uintptr_t) shmHeapPageSize(pd);
+	uintptr_t first = ((uintptr_t) curr->data + sizeof(SizeTree) + page - 1) & ~(page - 1);
+	uintptr_t last = (uintptr_t) chunkNext(curr) & ~(page - 1);
+
+	if(start) {
+		*start = (unsigned char *) first;
+	}
+	return (last > first) ? last - first : 0;
+}
+
+/* Give the interior of the free chunk "curr" back to the OS.  The heap is
+ * usually shared, and MADV_DONTNEED only drops our own view of shared pages,
+ * so MADV_REMOVE is tried first.  Returns the number of bytes purged.  The
+ * caller holds the lock.
+ */
+static size_t purgeChunk(privateData *pd, AllocStruct *curr)
+{
+	unsigned char *start;
+	size_t len = purgeRange(pd, curr, &start);
+
+	if(curr->purged || len == 0) {
+		return 0;
+	}
+
+	if(madvise(start, len, MADV_REMOVE) != 0 && madvise(start, len, MADV_DONTNEED) != 0) {
+		return 0;
+	}
+
+	curr->purged = 1;
+	shmHeapCountSet(pd->bytesPurged, pd->bytesPurged + len);
+	return len;
+}
+
+/* Purge every chunk of at least "minSize" bytes on the list that starts at
+ * "node" that's been free since before "cutoff".  A "cutoff" of UINT64_MAX
+ * means "no matter how long it's been free".  Returns the number of bytes
+ * purged. */
+static size_t purgeList(privateData *pd, SizeTree *node, size_t minSize, uint64_t cutoff)
+{
+	size_t bytes = 0;
+
+	for(; node; node = NODE(node->next)) {
+		AllocStruct *curr = sizeTreeChunk(node);
+		if(curr->size >= minSize && (cutoff == UINT64_MAX || node->freedAt <= cutoff)) {
+			bytes += purgeChunk(pd, curr);
+		}
+	}
+
+	return bytes;
+}
+
+/* The same as purgeList(), for every node in the Size Tree at "root". */
+static size_t purgeTree(privateData *pd, SizeTree *root, size_t minSize, uint64_t cutoff)
+{
+	SizeTree *tree;
+	size_t bytes = 0;
+
+	for(tree = sizeTreeLowest(pd, root, minSize); tree; tree = sizeTreeSuccessor(pd, tree)) {
+		bytes += purgeList(pd, tree, minSize, cutoff);
+	}
+
+	return bytes;
+}
+
+/* Purge every free chunk of at least "minSize" bytes that's been free since
+ * before "cutoff".  The caller holds the lock. */
+static size_t purgeAll(privateData *pd, size_t minSize, uint64_t cutoff)
+{
+	size_t bytes = 0;
+	int fl, sl;
+
+	if(minSize < SHM_HEAP_LARGE_SIZE) {
+		binMapping(minSize, &fl, &sl);
+		for(; fl < SHM_HEAP_FL_COUNT; fl++, sl = 0) {
+			for(; sl < SHM_HEAP_SL_COUNT; sl++) {
+				bytes += purgeList(pd, NODE(pd->binHeads[fl][sl]), minSize, cutoff);
+			}
+		}
+	}
+
+	return bytes + purgeTree(pd, NODE(pd->sizeTreeRoot), minSize, cutoff);
+}
+
+/* _shmHeapFree() just put "curr" into the Size Index.  If it's big enough,
+ * note when that happened, and purge whatever has been free long enough. */
+static void purgeTick(privateData *pd, AllocStruct *curr)
+{
+	if(curr->size < pd->purgeThreshold) {
+		return;
+	}
+
+	uint64_t now = shmHeapNow();
+	chunkNode(curr)->freedAt = now;
+
+	if(now >= pd->nextPurge) {
+		pd->nextPurge = now + pd->purgeDecay;
+		purgeAll(pd, pd->purgeThreshold, now - pd->purgeDecay);
+	}
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the public API.
+ ******************************************************************************
+ ******************************************************************************/
+
+/* Make sure "ptr" looks like something shmHeapMalloc() handed out.  This only
+ * reads the chunk's own header, so it's done before taking the lock.  Returns
+ * the chunk, or NULL if it's not valid. */
+static AllocStruct *shmHeapCheckChunk(void *ptr, const char *func)
+{
+	AllocStruct *curr = chunkFromData(ptr);
+	if(curr->magic != SHM_HEAP_CHUNK_MAGIC) {
+		fprintf(stderr, "%s(): ERROR: Invalid header.\n", func);
+		return NULL;
+	}
+
+	if(curr->allocated != 1) {
+		fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
+		        func, ptr);
+		return NULL;
+	}
+
+	return curr;
+}
+
+static void *_shmHeapMalloc(privateData *pd, size_t size)
+{
+	/* The Size Index can't be trusted. */
+	if(pd->damaged) {
+		return NULL;
+	}
+
+	size = shmHeapRoundSize(size);
+
+	void *ptr = quickMalloc(pd, size);
+	if(ptr) {
+		return ptr;
+	}
+
+	/* Before giving up, coalesce whatever is on the Quick Lists. */
+	SizeTree *sizeTreeNode = fitFindNode(pd, size);
+	if(sizeTreeNode == 0 && quickConsolidate(pd)) {
+		sizeTreeNode = fitFindNode(pd, size);
+	}
+	if(sizeTreeNode == 0) 	{
+		return (void *) NULL;
+	}
+
+	int success = sizeIndexRemoveNode(pd, sizeTreeNode);
+	if(success == 0) {
+		fprintf(stderr, "%s(): ERROR: Didn't find matching size node\n", __func__);
+	}
+
+	AllocStruct *curr = sizeTreeChunk(sizeTreeNode);
+	if(curr->magic != SHM_HEAP_CHUNK_MAGIC) {
+		fprintf(stderr, "%s(): ERROR: Invalid header.\n", __func__);
+	}
+
+	size_t currSize = curr->size;
+	size_t prevSize = curr->prevSize;
+
+	memset(curr, 0, sizeof(*curr));
+	curr->magic = SHM_HEAP_CHUNK_MAGIC;
+	curr->size = currSize;
+	curr->allocated = 1;
+	curr->owner = -1;
+	curr->prevSize = prevSize;
+
+	chunkSplit(pd, curr, size);
+
+	return curr->data;
+}
+
+/* Make sure an aligned request, plus the extra space _shmHeapAlignedMalloc()
+ * asks for, still fits in one chunk. */
+static int shmHeapAlignedFits(size_t alignment, size_t size)
+{
+	size_t extra = sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE;
+
+	return alignment <= SHM_HEAP_MAX_SIZE - extra &&
+	       size <= SHM_HEAP_MAX_SIZE - extra - alignment;
+}
+
+/* Allocate "size" bytes whose distance from "base" is a multiple of
+ * "alignment".  A "base" of 0 aligns the address itself.  We ask for enough
+ * extra space that an aligned chunk header is guaranteed to fit somewhere
+ * inside the chunk we get back.  Everything in front of that header becomes a
+ * free chunk of its own, and everything after "size" is split off as usual,
+ * so nothing is wasted.  "alignment" has to be a power of 2.
+ */
+static void *_shmHeapAlignedMalloc(privateData *pd, uintptr_t base, size_t alignment, size_t size)
+{
+	if(alignment <= SHM_HEAP_ALIGN) {
+		return _shmHeapMalloc(pd, size);
+	}
+	if(!shmHeapAlignedFits(alignment, size)) {
+		return NULL;
+	}
+
+	void *ptr = _shmHeapMalloc(pd, size + alignment + sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE);
+	if(ptr == NULL) {
+		return NULL;
+	}
+
+	AllocStruct *curr = chunkFromData(ptr);
+	if((((uintptr_t) curr->data - base) & (alignment - 1)) != 0) {
+		/* The leading chunk has to be big enough to hold a header and at
+		 * least SHM_HEAP_MIN_SIZE bytes of data. */
+		uintptr_t addr = (uintptr_t) curr->data + sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE - base;
+		addr = base + ((addr + alignment - 1) & ~((uintptr_t) alignment - 1));
+
+		AllocStruct *aligned = chunkFromData((void *) addr);
+		size_t leadSize = (unsigned char *) aligned - curr->data;
+
+		memset(aligned, 0, sizeof(*aligned));
+		aligned->magic = SHM_HEAP_CHUNK_MAGIC;
+		aligned->size = curr->size - leadSize - AllocStructDataOffset;
+		aligned->allocated = 1;
+		aligned->owner = -1;
+		aligned->prevSize = leadSize;
+		chunkNext(aligned)->prevSize = aligned->size;
+
+		curr->size = leadSize;
+		_shmHeapFree(pd, curr->data, 0);
+
+		curr = aligned;
+	}
+
+	chunkSplit(pd, curr, size);
+
+	return curr->data;
+}
+
+/* Cut "curr" (which is in use) down to "size" bytes, and free whatever is left
+ * over as a new chunk.  There has to be enough extra space to create a new
+ * AllocStruct header and SHM_HEAP_MIN_SIZE bytes of data.  If there isn't,
+ * "curr" keeps the extra bytes.  The caller holds the lock.
+ */
+static void chunkSplit(privateData *pd, AllocStruct *curr, size_t size)
+{
+	if(curr->size < size + sizeof(AllocStruct) + pd->minSplit) {
+		return;
+	}
+
+	size_t extraSize = curr->size - size - AllocStructDataOffset;
+	curr->size = size;
+
+	AllocStruct *extra = chunkNext(curr);
+	memset(extra, 0, sizeof(*extra));
+	extra->magic = SHM_HEAP_CHUNK_MAGIC;
+	extra->size = extraSize;
+	extra->allocated = 1;
+	extra->prevSize = curr->size;
+	_shmHeapFree(pd, extra->data, 0);
+}
+
+/* The "external" argument lets us know whether this call is coming from an
+ * external source.  If it is, then we want to add the amount of freed memory to
+ * our internal counters.  If it's an internal call, then don't add to the
+ * internal counters.
+ *
+ * The caller holds the lock, and has already validated the header.  We still
+ * claim the chunk here with chunkClaim(), because two processes can race to
+ * free the same pointer (and one of them might not be holding the lock), and
+ * only one of them can win.
+ */
+static void _shmHeapFree(privateData *pd, void *ptr, int external)
+{
+	AllocStruct *curr;
+	curr = chunkFromData(ptr);
+
+	if(!chunkClaim(curr, 0)) {
+		fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
+		        __func__, ptr);
+		return;
+	}
+
+	if(external) {
+		shmHeapCount(pd->bytesFree, curr->size);
+	}
+
+	chunkRelease(pd, curr);
+}
+
+/* Coalesce "curr" with its free neighbours and put it into the Size Index.
+ * The caller holds the lock, and has already claimed "curr" with
+ * chunkClaim(). */
+static void chunkRelease(privateData *pd, AllocStruct *curr)
+{
+	/* Check to see if the next memory block (a.k.a. the successor) is
+	 * currently free.  If it is, combine it with this memory block.  This
+	 * reduces fragmentation. */
+	AllocStruct *next = chunkNext(curr);
+	if(next->magic != SHM_HEAP_CHUNK_MAGIC) {
+		fprintf(stderr, "%s(): ERROR: Invalid header at next.\n", __func__);
+		return;
+	}
+	if(next->allocated == 0) {
+		int success = sizeIndexRemoveNode(pd, chunkNode(next));
+		if(success == 0) {
+			fprintf(stderr, "ERROR: Unable to locate sizeTreeNode.\n");
+		}
+
+		curr->size += next->size + AllocStructDataOffset;
+		memset(next, 0, sizeof(*next));
+	}
+
+	/* Check to see if the previous memory block (a.k.a. the predecessor) is
+	 * currently free.  If it is, combine it with this memory block.  This
+	 * reduces fragmentation.  The boundary tag tells us exactly where the
+	 * previous block starts, so there's nothing to search for. */
+	if(curr->prevSize != SHM_HEAP_NO_PREV) {
+		AllocStruct *prev = (AllocStruct *) ((unsigned char *) curr -
+		                    AllocStructDataOffset - curr->prevSize);
+		if(prev->magic != SHM_HEAP_CHUNK_MAGIC) {
+			fprintf(stderr, "%s(): ERROR: Invalid header at prev.\n", __func__);
+		}
+		else if(prev->allocated == 0) {
+			int success = sizeIndexRemoveNode(pd, chunkNode(prev));
+			if(success == 0) {
+				fprintf(stderr, "ERROR: Unable to locate sizeTreeNode.\n");
+			}
+
+			prev->size += curr->size + AllocStructDataOffset;
+			memset(curr, 0, sizeof(*curr));
+
+			curr = prev;
+		}
+	}
+
+	curr->allocated = 0;
+	curr->purged = 0;
+
+	/* Update the boundary tag in the chunk that follows us.  It has to
+	 * describe the (possibly combined) chunk we're about to free. */
+	next = chunkNext(curr);
+	next->prevSize = curr->size;
+
+	/* Place the chunk into the Size Index.  It is now available for
+	 * re-allocation. */
+	sizeIndexInsertNode(pd, chunkNode(curr));
+
+	purgeTick(pd, curr);
+}
+
+/* Try to make the in-use chunk "curr" hold "size" bytes without moving it.
+ * Shrinking always works; the tail is split off and freed.  Growing only
+ * works if the chunk that follows us is free and big enough, in which case we
+ * absorb it and split off whatever we don't need.  Returns 1 if "curr" now
+ * holds "size" bytes, or 0 if the caller has to move the data.  The caller
+ * holds the lock.
+ */
+static int _shmHeapResize(privateData *pd, AllocStruct *curr, size_t size)
+{
+	if(curr->allocated != 1) {
+		fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
+		        __func__, curr->data);
+		return 0;
+	}
+
+	if(size > curr->size) {
+		/* Growing takes from the Size Index, which can't be trusted. */
+		if(pd->damaged) {
+			return 0;
+		}
+
+		AllocStruct *next = chunkNext(curr);
+		if(next->magic != SHM_HEAP_CHUNK_MAGIC) {
+			fprintf(stderr, "%s(): ERROR: Invalid header at next.\n", __func__);
+			return 0;
+		}
+		if(next->allocated != 0 ||
+		   curr->size + AllocStructDataOffset + next->size < size) {
+			return 0;
+		}
+
+		int success = sizeIndexRemoveNode(pd, chunkNode(next));
+		if(success == 0) {
+			fprintf(stderr, "ERROR: Unable to locate sizeTreeNode.\n");
+		}
+
+		curr->size += next->size + AllocStructDataOffset;
+		memset(next, 0, sizeof(*next));
+
+		next = chunkNext(curr);
+		next->prevSize = curr->size;
+	}
+
+	chunkSplit(pd, curr, size);
+	return 1;
+}
+
+/* Allocate all "n" of "sizes" at once.  When we can, we find one free chunk
+ * that's big enough for all of them and carve it up, so the Size Index is only
+ * searched once.  Otherwise we fall back to one _shmHeapMalloc() per entry.
+ * Returns 1 if everything was allocated.  If anything fails, whatever we got
+ * is given back and 0 is returned.  The caller holds the lock.
+ */
+static int _shmHeapMallocBatch(privateData *pd, size_t alignment, const size_t sizes[],
+                               size_t n, void *out[])
+{
+	size_t i;
+
+	/* Carving doesn't keep anything but the first chunk aligned. */
+	if(alignment <= SHM_HEAP_ALIGN) {
+		size_t total = (n - 1) * AllocStructDataOffset;
+		for(i = 0; i < n; i++) {
+			total += shmHeapRoundSize(sizes[i]);
+		}
+
+		void *ptr = _shmHeapMalloc(pd, total);
+		if(ptr) {
+			AllocStruct *curr = chunkFromData(ptr);
+			for(i = 0; i < n; i++) {
+				out[i] = curr->data;
+				if(i == n - 1) {
+					/* The last one keeps whatever was too small
+					 * to split off, so the chunk after it has to
+					 * be told how big it ended up. */
+					chunkNext(curr)->prevSize = curr->size;
+					break;
+				}
+
+				size_t size = shmHeapRoundSize(sizes[i]);
+				size_t rest = curr->size - size - AllocStructDataOffset;
+				curr->size = size;
+
+				AllocStruct *next = chunkNext(curr);
+				memset(next, 0, sizeof(*next));
+				next->magic = SHM_HEAP_CHUNK_MAGIC;
+				next->size = rest;
+				next->allocated = 1;
+				next->owner = -1;
+				next->prevSize = curr->size;
+
+				curr = next;
+			}
+			return 1;
+		}
+	}
+
+	for(i = 0; i < n; i++) {
+		out[i] = _shmHeapAlignedMalloc(pd, 0, alignment, sizes[i]);
+		if(out[i] == NULL) {
+			while(i-- > 0) {
+				_shmHeapFree(pd, out[i], 0);
+				out[i] = NULL;
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* qsort() helper for shmHeapFreeBatch(). */
+static int shmHeapPtrCompare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) *(void * const *) a;
+	uintptr_t y = (uintptr_t) *(void * const *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Trim "heap" so that it starts and ends on a SHM_HEAP_ALIGN boundary.  Every
+ * chunk is a multiple of SHM_HEAP_ALIGN long, so this keeps all of the headers
+ * aligned. */
+static unsigned char *shmHeapAlign(unsigned char *heap, size_t *size)
+{
+	size_t pad = (SHM_HEAP_ALIGN - ((uintptr_t) heap & (SHM_HEAP_ALIGN - 1))) & (SHM_HEAP_ALIGN - 1);
+	if(size) {
+		*size = (*size - pad) & ~((size_t) SHM_HEAP_ALIGN - 1);
+	}
+	return heap + pad;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Thread Cache.
+ ******************************************************************************
+ ******************************************************************************/
+/* Each thread keeps a few free chunks of each small size to itself.  Most
+ * malloc/free pairs are served from here without taking the lock or touching
+ * the Size Index.  When a list runs dry it's refilled with a batch of chunks
+ * under a single lock, and when it fills up half of it is handed back the same
+ * way.
+ *
+ * A cached chunk is still marked as in use in its header ("allocated" is
+ * SHM_HEAP_CACHED), so nobody coalesces with it.  The lists are linked through
+ * the first word of each chunk's data.  Those links are plain pointers, since
+ * the cache is private to the thread.
+ *
+ * A thread has a cache for every entry in "arenas" that it uses (each CPU
+ * Arena has one of its own), so switching between heaps or parts never
+ * flushes anything.  The caches are made with calloc() the first time a
+ * thread needs one, and freed when the thread exits.
+ */
+#define SHM_HEAP_CACHED             2
+#define SHM_HEAP_CACHE_MAX_SIZE     1024
+#define SHM_HEAP_CACHE_BINS         ((SHM_HEAP_CACHE_MAX_SIZE >> SHM_HEAP_ALIGN_LOG2) + 1)
+#define SHM_HEAP_CACHE_DEFAULT_LIMIT 32
+
+typedef struct shmHeapCache {
+	/* The heap that the cached chunks belong to. */
+	privateData *pd;
+
+	/* One list per chunk size, in SHM_HEAP_ALIGN steps. */
+	void *head[SHM_HEAP_CACHE_BINS];
+	unsigned int count[SHM_HEAP_CACHE_BINS];
+} ShmHeapCache;
+
+static __thread ShmHeapCache *threadCache[SHM_HEAP_MAX_ARENAS];
+
+/* Set once the thread-exit destructor is armed for this thread. */
+static __thread int threadCacheRegistered;
+
+/* The most chunks of one size a thread may cache.  0 turns the cache off. */
+static unsigned int cacheLimit = SHM_HEAP_CACHE_DEFAULT_LIMIT;
+
+static pthread_key_t cacheKey;
+
+/* Hand the "count" chunks at the front of one list back to the heap.  This
+ * takes the lock once for the whole batch. */
+static void cacheFlushBin(ShmHeapCache *cache, int bin, unsigned int count)
+{
+	if(count == 0 || cache->head[bin] == NULL) {
+		return;
+	}
+
+	shmHeapLock(cache->pd);
+	while(count-- && cache->head[bin]) {
+		void *ptr = cache->head[bin];
+		cache->head[bin] = *(void **) ptr;
+		cache->count[bin]--;
+
+		AllocStruct *curr = chunkFromData(ptr);
+		curr->allocated = 1;
+		_shmHeapFree(cache->pd, ptr, 0);
+	}
+	shmHeapUnlock(cache->pd);
+}
+
+/* Hand everything in "cache" back to the heap. */
+static void cacheFlush(ShmHeapCache *cache)
+{
+	int bin;
+
+	if(cache->pd == NULL) {
+		return;
+	}
+
+	for(bin = 0; bin < SHM_HEAP_CACHE_BINS; bin++) {
+		cacheFlushBin(cache, bin, cache->count[bin]);
+	}
+}
+
+/* Hand everything in all of this thread's caches back. */
+static void cacheFlushAll(ShmHeapCache **caches)
+{
+	int i;
+	for(i = 0; i < SHM_HEAP_MAX_ARENAS; i++) {
+		if(caches[i]) {
+			cacheFlush(caches[i]);
+		}
+	}
+}
+
+/* Hand back whatever this thread has cached from "h". */
+static void cacheFlushHeap(ShmHeap *h)
+{
+	ShmHeapCache *cache = threadCache[h - arenas];
+	if(cache && cache->pd == h->pd) {
+		cacheFlush(cache);
+		cache->pd = NULL;
+	}
+}
+
+/* Runs when a thread that used the cache exits. */
+static void cacheThreadExit(void *arg)
+{
+	ShmHeapCache **caches = (ShmHeapCache **) arg;
+	int i;
+
+	cacheFlushAll(caches);
+	for(i = 0; i < SHM_HEAP_MAX_ARENAS; i++) {
+		free(caches[i]);
+		caches[i] = NULL;
+	}
+}
+
+/* Get this thread's cache for "h".  Returns NULL if the cache is turned
+ * off. */
+static ShmHeapCache *cacheGet(ShmHeap *h)
+{
+	ShmHeapCache **slot = &threadCache[h - arenas];
+	privateData *pd = h->pd;
+
+	if(cacheLimit == 0) {
+		return NULL;
+	}
+
+	if(threadCacheRegistered == 0) {
+		pthread_once(&processOnce, shmHeapProcessInit);
+		pthread_setspecific(cacheKey, threadCache);
+		threadCacheRegistered = 1;
+	}
+
+	if(*slot == NULL && (*slot = calloc(1, sizeof(**slot))) == NULL) {
+		return NULL;
+	}
+	ShmHeapCache *cache = *slot;
+
+	/* The entry has been used for some other heap since.  Its chunks
+	 * have to go home first. */
+	if(cache->pd != pd) {
+		cacheFlush(cache);
+		cache->pd = pd;
+	}
+
+	return cache;
+}
+
+/* Pop a chunk of "size" bytes (already rounded) off this thread's cache.  If
+ * the list is empty, refill it with a batch carved out of the heap first.
+ * Returns NULL if the chunk can't come from the cache. */
+static void *cacheMalloc(ShmHeap *h, size_t size)
+{
+	privateData *pd = h->pd;
+
+	if(size == 0 || size > SHM_HEAP_CACHE_MAX_SIZE) {
+		return NULL;
+	}
+
+	ShmHeapCache *cache = cacheGet(h);
+	if(cache == NULL) {
+		return NULL;
+	}
+
+	int bin = (int) (size >> SHM_HEAP_ALIGN_LOG2);
+	if(cache->head[bin] == NULL) {
+		unsigned int batch = (cacheLimit + 1) / 2;
+
+		shmHeapLock(pd);
+		while(batch--) {
+			void *ptr = _shmHeapMalloc(pd, size);
+			if(ptr == NULL) {
+				break;
+			}
+
+			AllocStruct *curr = chunkFromData(ptr);
+			curr->allocated = SHM_HEAP_CACHED;
+			*(void **) ptr = cache->head[bin];
+			cache->head[bin] = ptr;
+			cache->count[bin]++;
+		}
+		shmHeapUnlock(pd);
+
+		if(cache->head[bin] == NULL) {
+			return NULL;
+		}
+	}
+
+	void *ptr = cache->head[bin];
+	cache->head[bin] = *(void **) ptr;
+	cache->count[bin]--;
+
+	AllocStruct *curr = chunkFromData(ptr);
+	curr->allocated = 1;
+
+	return ptr;
+}
+
+/* Push "curr" onto this thread's cache.  If the list is full, half of it is
+ * handed back to the heap first.  Returns 0 if the chunk can't be cached. */
+static int cacheFree(ShmHeap *h, AllocStruct *curr)
+{
+	if(curr->size == 0 || curr->size > SHM_HEAP_CACHE_MAX_SIZE) {
+		return 0;
+	}
+
+	/* The cache doesn't know about alignment, so it can't be used when
+	 * every chunk has to be aligned. */
+	if(h->pd->minAlign > SHM_HEAP_ALIGN) {
+		return 0;
+	}
+
+	ShmHeapCache *cache = cacheGet(h);
+	if(cache == NULL || !chunkClaim(curr, SHM_HEAP_CACHED)) {
+		return 0;
+	}
+
+	int bin = (int) (curr->size >> SHM_HEAP_ALIGN_LOG2);
+	if(cache->count[bin] >= cacheLimit) {
+		cacheFlushBin(cache, bin, (cache->count[bin] + 1) / 2);
+	}
+	*(void **) curr->data = cache->head[bin];
+	cache->head[bin] = curr->data;
+	cache->count[bin]++;
+
+	return 1;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Remote Free Queues.
+ ******************************************************************************
+ ******************************************************************************/
+/* Every process that allocates from the heap claims one of the ProcSlots in
+ * the privateData header, and every chunk it allocates records that slot in
+ * its "owner" field.  When some other process frees the chunk, it doesn't
+ * take the lock.  It pushes the chunk onto the owner's queue with a single
+ * compare-and-swap, and the owner gives all of them back to the heap (and
+ * coalesces them) in one batch on its next malloc.
+ *
+ * The queue is a stack of chunk offsets, linked through the first word of
+ * each chunk's data.  Any number of processes can push.  Emptying it is a
+ * single exchange of the head, so it's also safe for more than one process to
+ * empty it.  A queued chunk is marked SHM_HEAP_REMOTE in its header, so it
+ * can't be freed twice and nobody coalesces with it.
+ */
+#define SHM_HEAP_REMOTE 3
+
+/* This protects the "slot" and "slotClaimed" members of every ShmHeap. */
+static pthread_mutex_t mySlotLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Give everything on "slot"'s queue back to the heap. */
+static void remoteDrain(privateData *pd, ProcSlot *slot)
+{
+	ShmOffset off = __atomic_exchange_n(&slot->remoteFree, 0, __ATOMIC_ACQUIRE);
+	if(off == 0) {
+		return;
+	}
+
+	shmHeapLock(pd);
+	while(off) {
+		AllocStruct *curr = shmHeapPtr(pd, off);
+		off = *(ShmOffset *) curr->data;
+
+		curr->allocated = 1;
+		_shmHeapFree(pd, curr->data, 0);
+	}
+	shmHeapUnlock(pd);
+}
+
+/* Empty every queue in the heap.  This is for when we're running low, and
+ * chunks might be stuck on the queue of a process that isn't allocating. */
+static void remoteDrainAll(privateData *pd)
+{
+	int i;
+	for(i = 0; i < SHM_HEAP_MAX_PROCS; i++) {
+		if(__atomic_load_n(&pd->procSlots[i].remoteFree, __ATOMIC_RELAXED)) {
+			remoteDrain(pd, &pd->procSlots[i]);
+		}
+	}
+}
+
+/* Give up our slot in "h".  Anything still on its queue is freed first. */
+static void remoteSlotRelease(ShmHeap *h)
+{
+	pthread_mutex_lock(&mySlotLock);
+	if(h->pd && h->slotClaimed && h->slot >= 0) {
+		ProcSlot *slot = &h->pd->procSlots[h->slot];
+		remoteDrain(h->pd, slot);
+		__atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+	}
+	h->slotClaimed = 0;
+	h->slot = -1;
+	pthread_mutex_unlock(&mySlotLock);
+}
+
+/* Get this process's slot in "h", claiming one the first time through.
+ * Returns -1 if every slot is taken. */
+static int remoteSlotGet(ShmHeap *h)
+{
+	if(__atomic_load_n(&h->slotClaimed, __ATOMIC_ACQUIRE)) {
+		return h->slot;
+	}
+
+	pthread_once(&processOnce, shmHeapProcessInit);
+
+	pthread_mutex_lock(&mySlotLock);
+	if(!h->slotClaimed) {
+		privateData *pd = h->pd;
+		pid_t me = getpid();
+		int pass, i;
+
+		/* Take an empty slot if there is one.  Otherwise take over the
+		 * slot of a process that died without giving its slot up. */
+		int mySlot = -1;
+		for(pass = 0; pass < 2 && mySlot < 0; pass++) {
+			for(i = 0; i < SHM_HEAP_MAX_PROCS; i++) {
+				ProcSlot *slot = &pd->procSlots[i];
+				pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+
+				if(pass == 0 && pid != 0) {
+					continue;
+				}
+				if(pass == 1 && (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH)) {
+					continue;
+				}
+				if(__atomic_compare_exchange_n(&slot->pid, &pid, me, 0,
+				                               __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+					mySlot = i;
+					break;
+				}
+			}
+		}
+
+		/* The last owner might have left some chunks behind. */
+		if(mySlot >= 0) {
+			remoteDrain(pd, &pd->procSlots[mySlot]);
+		}
+		h->slot = mySlot;
+		__atomic_store_n(&h->slotClaimed, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mySlotLock);
+
+	return h->slot;
+}
+
+/* If "curr" belongs to some other process, push it onto that process's
+ * queue.  Returns 0 if the chunk has to be freed here instead. */
+static int remoteFree(ShmHeap *h, AllocStruct *curr)
+{
+	privateData *pd = h->pd;
+	int owner = curr->owner;
+
+	if(owner < 0 || owner >= SHM_HEAP_MAX_PROCS || curr->size < sizeof(ShmOffset)) {
+		return 0;
+	}
+	if(h->slotClaimed && owner == h->slot) {
+		return 0;
+	}
+
+	ProcSlot *slot = &pd->procSlots[owner];
+	if(__atomic_load_n(&slot->pid, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+
+	/* If somebody else got to it first, this is a double free.  Let
+	 * _shmHeapFree() report it. */
+	if(!chunkClaim(curr, SHM_HEAP_REMOTE)) {
+		return 0;
+	}
+
+	ShmOffset off = shmHeapOff(pd, curr);
+	ShmOffset head = __atomic_load_n(&slot->remoteFree, __ATOMIC_RELAXED);
+	do {
+		*(ShmOffset *) curr->data = head;
+	} while(!__atomic_compare_exchange_n(&slot->remoteFree, &head, off, 1,
+	                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Quick Lists.
+ ******************************************************************************
+ ******************************************************************************/
+/* A heap made with ShmHeapOptions.quickLimit doesn't coalesce small chunks as
+ * soon as they're freed.  shmHeapFree() pushes them onto the Quick List for
+ * their exact size instead, without taking the lock, and the next malloc of
+ * that size takes one straight back off without searching the Size Index or
+ * splitting anything.  Code that frees something and then allocates another
+ * one just like it never pays for a coalesce that the next split would undo.
+ *
+ * The chunks on the Quick Lists are coalesced in bulk, only when it's needed:
+ * when a malloc can't find a free chunk, or when somebody calls
+ * shmHeapConsolidate() (from a maintenance thread, for example).  Once the
+ * lists hold "quickLimit" bytes, chunks are freed the usual way.
+ *
+ * Like the Remote Free Queues, each list is a stack of chunk offsets, linked
+ * through the first word of each chunk's data.  A chunk on a list is marked
+ * SHM_HEAP_CACHED, so nobody coalesces with it and it can't be freed twice.
+ * Anybody can push.  Only whoever holds the lock pops, so a chunk can't be
+ * popped and pushed again underneath somebody who is popping it.
+ */
+
+/* Push "curr" onto its Quick List.  Returns 0 if it has to be freed the
+ * usual way. */
+static int quickFree(privateData *pd, AllocStruct *curr)
+{
+	size_t size = curr->size;
+
+	if(pd->quickLimit == 0 || size > SHM_HEAP_QUICK_MAX_SIZE ||
+	   __atomic_load_n(&pd->quickBytes, __ATOMIC_RELAXED) + size > pd->quickLimit) {
+		return 0;
+	}
+
+	/* See remoteFree(). */
+	if(!chunkClaim(curr, SHM_HEAP_CACHED)) {
+		return 0;
+	}
+	shmHeapCount(pd->quickBytes, size);
+
+	ShmOffset *head = &pd->quickHeads[size >> SHM_HEAP_ALIGN_LOG2];
+	ShmOffset off = shmHeapOff(pd, curr);
+	ShmOffset next = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		*(ShmOffset *) curr->data = next;
+	} while(!__atomic_compare_exchange_n(head, &next, off, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+/* Pop a chunk of exactly "size" bytes (already rounded) off its Quick List.
+ * The caller holds the lock.  Returns NULL if the list is empty. */
+static void *quickMalloc(privateData *pd, size_t size)
+{
+	if(pd->quickLimit == 0 || size > SHM_HEAP_QUICK_MAX_SIZE) {
+		return NULL;
+	}
+
+	ShmOffset *head = &pd->quickHeads[size >> SHM_HEAP_ALIGN_LOG2];
+	ShmOffset off = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	AllocStruct *curr;
+	do {
+		if(off == 0) {
+			return NULL;
+		}
+		curr = shmHeapPtr(pd, off);
+	} while(!__atomic_compare_exchange_n(head, &off, *(ShmOffset *) curr->data, 1,
+	                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	__atomic_fetch_sub(&pd->quickBytes, curr->size, __ATOMIC_RELAXED);
+	curr->allocated = 1;
+	curr->owner = -1;
+
+	return curr->data;
+}
+
+/* Coalesce every chunk on the Quick Lists and put it into the Size Index.
+ * The caller holds the lock.  Returns the number of bytes that were on the
+ * lists. */
+static size_t quickConsolidate(privateData *pd)
+{
+	size_t bytes = 0;
+	int bin;
+
+	if(pd->quickLimit == 0 || __atomic_load_n(&pd->quickBytes, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+
+	for(bin = 0; bin < SHM_HEAP_QUICK_BINS; bin++) {
+		if(__atomic_load_n(&pd->quickHeads[bin], __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+
+		ShmOffset off = __atomic_exchange_n(&pd->quickHeads[bin], 0, __ATOMIC_ACQUIRE);
+		while(off) {
+			AllocStruct *curr = shmHeapPtr(pd, off);
+			off = *(ShmOffset *) curr->data;
+
+			bytes += curr->size;
+			curr->allocated = 1;
+			_shmHeapFree(pd, curr->data, 0);
+		}
+	}
+	__atomic_fetch_sub(&pd->quickBytes, bytes, __ATOMIC_RELAXED);
+
+	return bytes;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Trace Ring.
+ ******************************************************************************
+ ******************************************************************************/
+/* A heap can be created with a ring of ShmHeapTraceRecords in it.  Every
+ * malloc and free appends a record saying how long it took, so a reader (in
+ * any process) can tell whether the allocator is to blame for a slow request.
+ *
+ * Writers never wait for each other or for the reader.  A writer claims a
+ * record by bumping "traceHead", fills it in, and then publishes it by
+ * storing its sequence number plus 1 in "seq".  "seq" is 0 while the record
+ * is being written.  If the reader falls more than a ring behind, the oldest
+ * records are overwritten; the reader sees that as a gap in the sequence
+ * numbers.
+ *
+ * When the heap has no ring, all of this costs one load and a branch at the
+ * start and end of each call.
+ */
+
+/* This process's pid.  getpid() is a system call, so it's looked up once. */
+static pid_t tracePid = 0;
+
+/* A timestamp for the Trace Ring.  It's the TSC where there is one, and
+ * nanoseconds everywhere else. */
+static uint64_t traceCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return shmHeapNowNs();
+#endif
+}
+
+/* Call this at the start of a traced call.  Returns the start time. */
+static uint64_t traceStart(privateData *pd)
+{
+	if(pd->traceRing == 0) {
+		return 0;
+	}
+	traceDepth = 0;
+	return traceCycles();
+}
+
+/* Call this at the end of a traced call.  "ptr" is the chunk's data, or NULL
+ * if a malloc failed. */
+static void traceEnd(privateData *pd, int op, size_t size, void *ptr, uint64_t start)
+{
+	if(pd->traceRing == 0) {
+		return;
+	}
+	uint64_t cycles = traceCycles() - start;
+
+	if(tracePid == 0) {
+		tracePid = getpid();
+	}
+
+	uint64_t seq = __atomic_fetch_add(&pd->traceHead, 1, __ATOMIC_RELAXED);
+	ShmHeapTraceRecord *rec = (ShmHeapTraceRecord *) shmHeapPtr(pd, pd->traceRing) + (seq & pd->traceMask);
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->size = size;
+	rec->offset = (ptr) ? shmHeapOff(pd, ptr) : 0;
+	rec->cycles = cycles;
+	rec->pid = (uint32_t) tracePid;
+	rec->depth = (traceDepth > UINT16_MAX) ? UINT16_MAX : (uint16_t) traceDepth;
+	rec->op = (uint8_t) op;
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Set up a ring of at least "entries" records.  The caller holds the lock. */
+static void traceInit(privateData *pd, size_t entries)
+{
+	size_t count = 1;
+	while(count < entries) {
+		count <<= 1;
+	}
+
+	void *ring = _shmHeapMalloc(pd, count * sizeof(ShmHeapTraceRecord));
+	if(ring == NULL) {
+		fprintf(stderr, "%s(): WARNING: No room for %zu trace records.  Tracing is off.\n",
+		        __func__, count);
+		return;
+	}
+	memset(ring, 0, count * sizeof(ShmHeapTraceRecord));
+
+	pd->traceMask = count - 1;
+	pd->traceRing = shmHeapOff(pd, ring);
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the Growable Heaps.
+ ******************************************************************************
+ ******************************************************************************/
+/* shmHeapCreate() makes a heap that owns its backing store: a memfd, or a
+ * POSIX shared memory object if it has a name.  Every process that uses it
+ * maps the whole "maxSize" range up front, but only the first "heapSize"
+ * bytes of the object exist.  When the heap runs out of memory, whoever is
+ * holding the lock makes the object bigger with ftruncate() and turns the new
+ * space into one more free chunk, which moves the endStruct forward.  All of
+ * that is recorded in the heap, and every process already has the new space
+ * mapped, so the other processes just start using it.
+ */
+#define SHM_HEAP_GROW_MIN     (1024 * 1024)
+
+/* Make the heap big enough to add a free chunk of at least "need" bytes at
+ * the end.  Only a process that mapped the heap itself has a descriptor to
+ * grow it with.  A heap that's split into CPU Arenas is different: its object
+ * is full size from the start, and each part grows within its own stretch of
+ * it, so any process can grow a part.  The caller holds the lock.  Returns 1
+ * if the heap grew. */
+static int _shmHeapGrow(ShmHeap *h, size_t need)
+{
+	privateData *pd = h->pd;
+	size_t page = shmHeapPageSize(pd);
+	int split = (pd->cpuArenas > 1);
+
+	if(pd->maxSize == 0 || (!split && h->mapSize == 0)) {
+		return 0;
+	}
+
+	/* At least double the heap, so growing doesn't happen often. */
+	size_t grow = need + sizeof(AllocStruct);
+	if(grow < pd->heapSize) {
+		grow = pd->heapSize;
+	}
+	if(grow < SHM_HEAP_GROW_MIN) {
+		grow = SHM_HEAP_GROW_MIN;
+	}
+	size_t newSize = (pd->heapSize + grow + page - 1) & ~(page - 1);
+	if(newSize > pd->maxSize) {
+		newSize = pd->maxSize;
+	}
+	if(newSize < pd->heapSize + need + sizeof(AllocStruct)) {
+		return 0;
+	}
+
+	if(!split && ftruncate(h->mapFd, newSize) != 0) {
+		fprintf(stderr, "%s(): ERROR: ftruncate() failed: %s.\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	/* The old endStruct becomes the header of the new chunk, and a new
+	 * endStruct goes at the new end.  It already has the right boundary
+	 * tag. */
+	AllocStruct *newStruct = (AllocStruct *) ((unsigned char *) pd + pd->heapSize - sizeof(AllocStruct));
+	AllocStruct *endStruct = (AllocStruct *) ((unsigned char *) pd + newSize - sizeof(AllocStruct));
+
+	memset(endStruct, 0, sizeof(*endStruct));
+	endStruct->magic = SHM_HEAP_CHUNK_MAGIC;
+	endStruct->size = 0;
+	endStruct->allocated = 1;
+	endStruct->owner = -1;
+
+	newStruct->size = (unsigned char *) endStruct - newStruct->data;
+	newStruct->allocated = 1;
+	newStruct->owner = -1;
+	pd->heapSize = newSize;
+
+	_shmHeapFree(pd, newStruct->data, 0);
+	return 1;
+}
+
+/* Map "maxSize" bytes of "fd" at an address that's a multiple of "align".
+ * Transparent huge pages are only used where the mapping and the file line up
+ * on huge page boundaries, so for those we reserve a bit more address space
+ * than we need and trim it.  Returns MAP_FAILED on failure.
+ */
+static void *shmHeapMap(int fd, size_t maxSize, size_t align)
+{
+	if(align <= (size_t) getpagesize()) {
+		return mmap(NULL, maxSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+
+	unsigned char *reserve = mmap(NULL, maxSize + align, PROT_NONE,
+	                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(reserve == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	unsigned char *heap = (unsigned char *) (((uintptr_t) reserve + align - 1) & ~((uintptr_t) align - 1));
+	if(mmap(heap, maxSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(reserve, maxSize + align);
+		return MAP_FAILED;
+	}
+
+	if(heap > reserve) {
+		munmap(reserve, heap - reserve);
+	}
+	munmap(heap + maxSize, reserve + align - heap);
+
+	return heap;
+}
+
+/* Forget about whatever this process mapped for "h". */
+static void shmHeapUnmap(ShmHeap *h)
+{
+	if(h->mapSize) {
+		munmap(h->pd, h->mapSize);
+		close(h->mapFd);
+		h->mapSize = 0;
+		h->mapFd = -1;
+	}
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of the CPU Arenas.
+ ******************************************************************************
+ ******************************************************************************/
+/* A heap can be split into CPU Arenas, so that threads on different CPUs
+ * don't all fight over one lock.  The memory is cut into equal parts, and
+ * each part is a complete heap with its own privateData header, lock, Size
+ * Index, Remote Free Queues and statistics.  The parts sit at fixed distances
+ * from the first one, so every process finds them the same way, and the part
+ * that a chunk belongs to is found from its address with one division.
+ *
+ * A malloc goes to the part for the CPU that the thread is running on, and
+ * only tries the other parts if that one is out of memory.  A free always goes
+ * back to the part the chunk came from.  Only the first part has a Trace Ring,
+ * and the other parts record into it.
+ */
+
+/* Threads that can't find out which CPU they're on stick to one part each.
+ * The parts are handed out round robin. */
+static __thread int cpuArenaHint = -1;
+static unsigned int cpuArenaNext = 0;
+
+/* Pick the part of "h" that this thread should allocate from. */
+static int cpuArenaPick(ShmHeap *h)
+{
+	if(h->cpuCount <= 1) {
+		return 0;
+	}
+
+	int cpu = sched_getcpu();
+	if(cpu < 0) {
+		if(cpuArenaHint < 0) {
+			cpuArenaHint = (int) (__atomic_fetch_add(&cpuArenaNext, 1, __ATOMIC_RELAXED) & INT_MAX);
+		}
+		cpu = cpuArenaHint;
+	}
+
+	return cpu % h->cpuCount;
+}
+
+/* Start using the CPU Arenas of the heap whose first part is at "pd", as
+ * "h".  Every part but the first gets an entry of its own in "arenas".  The
+ * caller holds "arenaLock".  Returns 0 on success or -1 on failure. */
+static int cpuArenasAttach(ShmHeap *h, privateData *pd)
+{
+	int count = (int) pd->cpuArenas;
+	int i;
+
+	h->pd = pd;
+	h->slot = -1;
+	h->cpuCount = count;
+	h->cpuStride = pd->cpuArenaStride;
+	h->cpu[0] = h;
+	h->low = (uintptr_t) pd;
+	h->high = h->low + count * h->cpuStride;
+
+	for(i = 1; i < count; i++) {
+		ShmHeap *part = arenaNew();
+		if(part == NULL) {
+			h->cpuCount = i;
+			cpuArenasDetach(h);
+			h->pd = NULL;
+			h->low = h->high = 0;
+			return -1;
+		}
+		part->pd = (privateData *) ((unsigned char *) pd + i * h->cpuStride);
+		part->root = h;
+		h->cpu[i] = part;
+	}
+
+	return 0;
+}
+
+/* Let go of every part of "h" but the first.  The caller holds
+ * "arenaLock". */
+static void cpuArenasDetach(ShmHeap *h)
+{
+	int i;
+
+	for(i = 1; i < h->cpuCount; i++) {
+		ShmHeap *part = h->cpu[i];
+		cacheFlushHeap(part);
+		remoteSlotRelease(part);
+		part->pd = NULL;
+		part->root = NULL;
+	}
+	h->cpuCount = 0;
+	h->cpuStride = 0;
+}
+
+/* Cut the memory at "heap" into "opts->cpuArenas" parts, "stride" bytes
+ * apart, set up the first "initial" bytes of each one as a heap, and start
+ * using them as "h".  If "grow" is set, each part can grow to "stride" bytes
+ * later on.  The caller holds "arenaLock".  Returns 0 on success or -1 on
+ * failure.
+ */
+static int cpuArenasInit(ShmHeap *h, unsigned char *heap, size_t stride, size_t initial, int grow,
+                         const ShmHeapOptions *opts)
+{
+	ShmHeapOptions partOpts = *opts;
+	unsigned int i, count = opts->cpuArenas;
+
+	if(count > SHM_HEAP_MAX_CPU_ARENAS) {
+		fprintf(stderr, "%s(): ERROR: A heap can't have more than %d CPU Arenas.\n",
+		        __func__, SHM_HEAP_MAX_CPU_ARENAS);
+		return -1;
+	}
+	if(initial < sizeof(privateData) + 2 * sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE) {
+		fprintf(stderr, "%s(): ERROR: The heap is too small for %u CPU Arenas.\n", __func__, count);
+		return -1;
+	}
+
+	partOpts.cpuArenas = 0;
+	for(i = 0; i < count; i++) {
+		ShmHeap part;
+		memset(&part, 0, sizeof(part));
+		arenaInit(&part, heap + i * stride, initial, &partOpts);
+		if(part.pd == NULL) {
+			return -1;
+		}
+
+		/* Only the first part gets a Trace Ring. */
+		partOpts.traceEntries = 0;
+
+		part.pd->cpuArenas = count;
+		part.pd->cpuArenaIndex = i;
+		part.pd->cpuArenaStride = stride;
+		if(grow) {
+			part.pd->heapSize = initial;
+			part.pd->maxSize = stride;
+		}
+	}
+
+	return cpuArenasAttach(h, (privateData *) heap);
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** This is the implementation of Persistent Heaps.
+ ******************************************************************************
+ ******************************************************************************/
+/* shmHeapOpen() keeps a heap in an ordinary file (on tmpfs, or on a disk), so
+ * whatever is in it outlives the processes that use it.  Nothing in the heap
+ * depends on where it's mapped: every link is an offset, and the header says
+ * which layout the heap was written with.  Opening a heap that's still in the
+ * file just maps it and checks the header; nothing else is looked at.
+ *
+ * Every process that has the file open holds a read lock on byte 1 of it, and
+ * whoever is opening it holds a write lock on byte 0.  So whoever opens it
+ * while nobody else is using it can tell, and knows that everything in the
+ * header that belongs to running processes is stale: the lock, the ProcSlots
+ * and the Remote Free Queues.  Those are reset.
+ *
+ * A process that died while holding the heap lock might have left the Size
+ * Index half updated (see "damaged").  Whoever takes the lock next rebuilds
+ * it on the spot, from the free chunks, while the other processes carry on.
+ * A process that went away without detaching might have left chunks in its
+ * Thread Caches (see "users").  That can only be fixed when nobody else is
+ * using the heap, so the Size Index is rebuilt again from the chunks
+ * themselves, walking from the first to the endStruct.  Chunks that are
+ * in use stay that way.  Every other chunk is free, including the ones that
+ * were on the Quick Lists, on a Remote Free Queue, or in some dead process's
+ * Thread Cache, and free chunks that sit next to each other are combined.
+ */
+#define SHM_HEAP_FILE_OPENING 0
+#define SHM_HEAP_FILE_USERS   1
+
+/* Return NULL if "pd" is the header of a heap that this code can use, or
+ * what's wrong with it if it's not. */
+static const char *shmHeapCheckHeader(const privateData *pd)
+{
+	if(pd->magic != SHM_HEAP_MAGIC) {
+		return "No heap";
+	}
+	if(pd->version != SHM_HEAP_VERSION || pd->headerSize != sizeof(*pd)) {
+		return "Incompatible heap version";
+	}
+	return NULL;
+}
+
+/* Set the lock on byte "which" of "fd" to "type" (F_RDLCK, F_WRLCK or
+ * F_UNLCK), waiting for it if "wait" is set.  These locks belong to the open
+ * file, not the process, so they go away when the descriptor is closed.
+ * Returns 0 on success or -1 on failure. */
+static int heapFileLock(int fd, int which, short type, int wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = which;
+	fl.l_len = 1;
+
+	return fcntl(fd, (wait) ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+/* Returns 1 if "curr" looks like a whole chunk that ends at or before
+ * "endStruct". */
+static int heapChunkValid(AllocStruct *curr, AllocStruct *endStruct)
+{
+	return curr->magic == SHM_HEAP_CHUNK_MAGIC && (curr->size & (SHM_HEAP_ALIGN - 1)) == 0 &&
+	       curr->size <= (size_t) ((unsigned char *) endStruct - curr->data);
+}
+
+/* The header that should follow "last" isn't there.  That happens when the
+ * process died in between shrinking "last" and writing the header of the
+ * piece it cut off.  The chunk after that still has a boundary tag that
+ * points back at "last", so look for it.  Returns "endStruct" if there's no
+ * such chunk. */
+static AllocStruct *heapChunkFind(AllocStruct *last, AllocStruct *endStruct)
+{
+	unsigned char *p;
+
+	for(p = (unsigned char *) chunkNext(last) + SHM_HEAP_ALIGN; p < (unsigned char *) endStruct; p += SHM_HEAP_ALIGN) {
+		AllocStruct *curr = (AllocStruct *) p;
+		if(curr->prevSize == (size_t) (p - last->data) && heapChunkValid(curr, endStruct)) {
+			return curr;
+		}
+	}
+
+	return endStruct;
+}
+
+/* Rebuild the Size Index of "pd" from its chunks, and fix every boundary tag
+ * along the way.  If "live" is 0, nobody else is using the heap, and every
+ * chunk that isn't in use is freed, whatever list it was on.  If "live" is 1,
+ * other processes are still running and we hold the lock; the Quick Lists,
+ * Thread Caches and Remote Free queues are left alone, and only chunks that
+ * were already free are put back on the Size Index.  Only the first region
+ * of the heap is walked, so the free chunks of any memory that was added with
+ * another shmHeapInit() call aren't found again.  Returns 0 on success, or -1
+ * if the first chunk is gone too. */
+static int heapRecover(privateData *pd, int live)
+{
+	AllocStruct *first = (AllocStruct *) ((unsigned char *) pd + sizeof(*pd));
+	AllocStruct *endStruct = (AllocStruct *) ((unsigned char *) pd + pd->heapSize - sizeof(AllocStruct));
+	AllocStruct *curr, *last = NULL;
+	uint64_t inUse = 0;
+
+	if(pd->heapSize == 0 || !heapChunkValid(first, endStruct)) {
+		return -1;
+	}
+
+	/* Everything that was on these is found again below. */
+	pd->sizeTreeRoot = 0;
+	pd->binFlBitmap = 0;
+	memset(pd->binSlBitmap, 0, sizeof(pd->binSlBitmap));
+	memset(pd->binHeads, 0, sizeof(pd->binHeads));
+	pd->freeChunkBytes = 0;
+	pd->freeChunks = 0;
+	memset(pd->freeClasses, 0, sizeof(pd->freeClasses));
+	pd->largestFree = 0;
+	if(!live) {
+		pd->quickBytes = 0;
+		memset(pd->quickHeads, 0, sizeof(pd->quickHeads));
+		memset(pd->procSlots, 0, sizeof(pd->procSlots));
+	}
+	pd->fitRover = 0;
+	pd->bytesPurged = 0;
+
+	/* Walk the chunks, and combine every run of chunks that aren't in use
+	 * into one free chunk. */
+	curr = first;
+	while(curr != endStruct) {
+		if(!heapChunkValid(curr, endStruct)) {
+			AllocStruct *next = heapChunkFind(last, endStruct);
+			last->size = (unsigned char *) next - last->data;
+			curr = next;
+			continue;
+		}
+
+		curr->prevSize = (last) ? last->size : SHM_HEAP_NO_PREV;
+		AllocStruct *next = chunkNext(curr);
+
+		if(curr->allocated == 1 || (live && curr->allocated != 0)) {
+			inUse += curr->size;
+			last = curr;
+		}
+		else if(last && last->allocated == 0) {
+			last->size += curr->size + AllocStructDataOffset;
+			memset(curr, 0, sizeof(*curr));
+		}
+		else {
+			curr->allocated = 0;
+			curr->owner = -1;
+			curr->purged = 0;
+			last = curr;
+		}
+		curr = next;
+	}
+
+	memset(endStruct, 0, sizeof(*endStruct));
+	endStruct->magic = SHM_HEAP_CHUNK_MAGIC;
+	endStruct->size = 0;
+	endStruct->allocated = 1;
+	endStruct->owner = -1;
+	endStruct->prevSize = last->size;
+
+	uint64_t now = shmHeapNow();
+	for(curr = first; curr != endStruct; curr = chunkNext(curr)) {
+		if(curr->allocated == 0) {
+			if(curr->size >= pd->purgeThreshold) {
+				chunkNode(curr)->freedAt = now;
+			}
+			sizeIndexInsertNode(pd, chunkNode(curr));
+		}
+	}
+
+	/* Whatever was lost in the Thread Caches counts as freed. */
+	if(!live) {
+		uint64_t bytesMalloc = pd->bytesMalloc;
+		pd->bytesFree = (bytesMalloc > inUse) ? bytesMalloc - inUse : 0;
+	}
+	pd->damaged = 0;
+
+	return 0;
+}
+
+/* "h" was just attached to a heap in a file that no other process has open.
+ * Reset whatever belonged to the processes that used it before, and rebuild
+ * the Size Index if it needs it.  "path" is for the messages.  Returns 0 on
+ * success or -1 on failure. */
+static int heapReopen(ShmHeap *h, const char *path)
+{
+	int i;
+
+	/* Every process that detached took itself off "users".  Anybody who
+	 * is still on it went away without flushing its caches. */
+	int unclean = (h->pd->users != 0);
+	h->pd->users = 0;
+
+	for(i = 0; i < arenaParts(h); i++) {
+		privateData *pd = arenaPart(h, i)->pd;
+
+		/* Nobody can be holding the lock now, whatever it says. */
+		shmHeapLockInit(pd);
+		pd->nextPurge = 0;
+
+		if(pd->dirty || pd->damaged || unclean) {
+			fprintf(stderr, "%s(): WARNING: Rebuilding the heap in %s after a crash.\n", __func__, path);
+			if(heapRecover(pd, 0) != 0) {
+				fprintf(stderr, "%s(): ERROR: The heap in %s is too badly damaged.\n", __func__, path);
+				return -1;
+			}
+			pd->dirty = 0;
+		}
+		else {
+			remoteDrainAll(pd);
+			memset(pd->procSlots, 0, sizeof(pd->procSlots));
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ **** These are the process-wide hooks.
+ ******************************************************************************
+ ******************************************************************************/
+/* Runs when the process exits.  Thread-exit destructors don't run for the
+ * main thread, so its cache is flushed here.  Then our slot is given up. */
+static void shmHeapProcessExit(void)
+{
+	int i;
+
+	cacheFlushAll(threadCache);
+	for(i = 0; i < arenaCount; i++) {
+		remoteSlotRelease(&arenas[i]);
+	}
+}
+
+/* Runs in the parent just before fork().  The child gets a copy of this
+ * thread's caches, and the same chunks can't be handed out twice. */
+static void shmHeapForkPrepare(void)
+{
+	cacheFlushAll(threadCache);
+}
+
+/* Runs in the child after fork().  The slots belong to the parent.  The child
+ * claims its own the first time it allocates. */
+static void shmHeapForkChild(void)
+{
+	int i;
+
+	pthread_mutex_init(&mySlotLock, NULL);
+	pthread_mutex_init(&arenaLock, NULL);
+	for(i = 0; i < arenaCount; i++) {
+		arenas[i].slotClaimed = 0;
+		arenas[i].slot = -1;
+		if(arenas[i].user) {
+			__atomic_fetch_add(&arenas[i].pd->users, 1, __ATOMIC_RELAXED);
+		}
+	}
+	tracePid = 0;
+}
+
+static void shmHeapProcessInit(void)
+{
+	pthread_key_create(&cacheKey, cacheThreadExit);
+	pthread_atfork(shmHeapForkPrepare, NULL, shmHeapForkChild);
+	atexit(shmHeapProcessExit);
+}
+
+/*******************************************************************************
+ * Public API starts here.
+ ******************************************************************************/
+
+/* This function can be called more than once if you want to manage more than
+ * 1 chunk of memory.  Links between the chunks are stored as offsets from the
+ * first one, so a process that shares the heap has to map all of them at the
+ * same distance from each other.
+ */
+void shmHeapInit(unsigned char *heap, size_t size)
+{
+	shmHeapInitWithOptions(heap, size, NULL);
+}
+
+/* The same as shmHeapInit(), but with settings.  "opts" can be NULL.  The
+ * settings are only used by the call that creates the heap; later calls that
+ * add more memory to it ignore them.
+ */
+void shmHeapInitWithOptions(unsigned char *heap, size_t size, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	arenaInit(defaultHeap, heap, size, opts);
+	pthread_mutex_unlock(&arenaLock);
+}
+
+/* This does the work for shmHeapInitWithOptions() and shmHeapInitArena().  The
+ * caller holds "arenaLock". */
+static void arenaInit(ShmHeap *h, unsigned char *heap, size_t size, const ShmHeapOptions *opts)
+{
+	size_t minAlign = (opts) ? opts->minAlign : 0;
+	if(minAlign & (minAlign - 1)) {
+		fprintf(stderr, "%s(): ERROR: minAlign %zu is not a power of 2.\n", __func__, minAlign);
+		return;
+	}
+	if(minAlign < SHM_HEAP_ALIGN) {
+		minAlign = SHM_HEAP_ALIGN;
+	}
+
+	unsigned int fitPolicy = (opts) ? opts->fitPolicy : SHM_HEAP_FIT_GOOD;
+	if(fitPolicy > SHM_HEAP_FIT_NEXT) {
+		fprintf(stderr, "%s(): ERROR: Unknown fitPolicy %u.\n", __func__, fitPolicy);
+		return;
+	}
+	size_t minSplit = (opts && opts->minSplit > SHM_HEAP_MIN_SIZE) ? opts->minSplit : SHM_HEAP_MIN_SIZE;
+	minSplit = shmHeapRoundSize(minSplit);
+
+	/* A chunk has to have room for its SizeTree node and at least one
+	 * whole page before it's worth purging. */
+	size_t purgeThreshold = (opts && opts->purgeThreshold) ? opts->purgeThreshold : SHM_HEAP_PURGE_DEFAULT_THRESHOLD;
+	if(purgeThreshold < sizeof(SizeTree) + 2 * (size_t) getpagesize()) {
+		purgeThreshold = sizeof(SizeTree) + 2 * (size_t) getpagesize();
+	}
+	unsigned int purgeDecay = (opts && opts->purgeDecayMs) ? opts->purgeDecayMs : SHM_HEAP_PURGE_DEFAULT_DECAY;
+	unsigned int hugePages = (opts) ? opts->hugePages : SHM_HEAP_HUGE_NONE;
+
+	heap = shmHeapAlign(heap, &size);
+
+	/* The parts of a heap that's split into CPU Arenas are set up one at a
+	 * time, each as a heap of its own.  The few bytes left over at the end
+	 * aren't used. */
+	if(h->pd == NULL && opts && opts->cpuArenas > 1) {
+		size_t stride = (size / opts->cpuArenas) & ~((size_t) getpagesize() - 1);
+		cpuArenasInit(h, heap, stride, stride, 0, opts);
+		return;
+	}
+
+	/* Set up our private data area at the beginning of the first heap
+	 * chunk that is passed to us. */
+	int first = (h->pd == NULL);
+	if(first) {
+		h->pd = (privateData *) heap;
+		h->low = (uintptr_t) heap;
+		h->high = (uintptr_t) heap + size;
+		h->slot = -1;
+		memset(h->pd, 0, sizeof(*h->pd));
+		h->pd->magic = SHM_HEAP_MAGIC;
+		h->pd->version = SHM_HEAP_VERSION;
+		h->pd->headerSize = sizeof(*h->pd);
+		h->pd->minAlign = minAlign;
+		h->pd->purgeThreshold = purgeThreshold;
+		h->pd->purgeDecay = purgeDecay;
+		h->pd->quickLimit = (opts) ? opts->quickLimit : 0;
+		h->pd->fitPolicy = fitPolicy;
+		h->pd->fitPercent = (opts) ? opts->fitPercent : 0;
+		h->pd->minSplit = minSplit;
+		h->pd->heapSize = size;
+
+		/* We didn't map this memory, so the best we can do is ask for
+		 * transparent huge pages. */
+		if(hugePages != SHM_HEAP_HUGE_NONE) {
+			if(shmHeapAdviseHuge(heap, size) == 0) {
+				shmHeapSetHugePages(h->pd);
+			}
+			else {
+				fprintf(stderr, "%s(): WARNING: Huge pages aren't available (%s).  Using normal pages.\n",
+				        __func__, strerror(errno));
+			}
+		}
+		shmHeapLockInit(h->pd);
+		heap += sizeof(*h->pd);
+		size -= sizeof(*h->pd);
+	}
+
+	unsigned char *heapEnd = heap + size;
+
+	/* Create a dummy AllocStruct data structure at the end of this heap.
+	 * We use that data structure as a flag to let us know it's the end of
+	 * this heap (and we can't go past it). */
+	AllocStruct *endStruct = (AllocStruct *) (heapEnd - sizeof(AllocStruct));
+	memset(endStruct, 0, sizeof(*endStruct));
+	endStruct->magic = SHM_HEAP_CHUNK_MAGIC;
+	endStruct->size = 0;
+	endStruct->allocated = 1;
+
+	/* Adjust size to allow for endStruct. */
+	size -= sizeof(*endStruct);
+
+	/* Create an AllocStruct data structure that matches the format that is
+	 * created by shmHeapMalloc().  Then pass it to _shmHeapFree().  This
+	 * way it looks like a regular call to _shmHeapFree(). */
+	AllocStruct *newStruct = (AllocStruct *) heap;
+	memset(newStruct, 0, sizeof(*newStruct));
+	newStruct->magic = SHM_HEAP_CHUNK_MAGIC;
+	newStruct->size = size - AllocStructDataOffset;
+	newStruct->allocated = 1;
+	newStruct->prevSize = SHM_HEAP_NO_PREV;
+
+	shmHeapLock(h->pd);
+	_shmHeapFree(h->pd, newStruct->data, 0);
+	if(first && opts && opts->traceEntries) {
+		traceInit(h->pd, opts->traceEntries);
+	}
+	shmHeapUnlock(h->pd);
+}
+
+/* Start using a heap that some other process already set up with
+ * shmHeapInit().  "heap" is wherever the heap is mapped in this process.
+ * Returns 0 on success, or -1 if there's no heap there.
+ */
+int shmHeapAttach(unsigned char *heap)
+{
+	privateData *pd = (privateData *) shmHeapAlign(heap, NULL);
+	const char *err = shmHeapCheckHeader(pd);
+	if(err) {
+		fprintf(stderr, "%s(): ERROR: %s at %p.\n", __func__, err, heap);
+		return -1;
+	}
+
+	pthread_mutex_lock(&arenaLock);
+	arenaDetach(defaultHeap);
+	int ret = 0;
+	if(pd->cpuArenas > 1) {
+		ret = cpuArenasAttach(defaultHeap, pd);
+	}
+	else {
+		defaultHeap->pd = pd;
+		defaultHeap->slot = -1;
+	}
+	pthread_mutex_unlock(&arenaLock);
+
+	return ret;
+}
+
+/* Stop using the heap in this process.  Anything the calling thread has
+ * cached is handed back first.  Call this before unmapping the heap; other
+ * threads should call shmHeapCacheFlush() before they stop using it.
+ */
+void shmHeapDetach(void)
+{
+	pthread_mutex_lock(&arenaLock);
+	arenaDetach(defaultHeap);
+	pthread_mutex_unlock(&arenaLock);
+}
+
+/* This does the work for shmHeapDetach() and shmHeapDetachArena().  The caller
+ * holds "arenaLock". */
+static void arenaDetach(ShmHeap *h)
+{
+	if(h->pd == NULL) {
+		return;
+	}
+
+	cacheFlushHeap(h);
+	remoteSlotRelease(h);
+	if(h->user) {
+		__atomic_fetch_sub(&h->pd->users, 1, __ATOMIC_RELEASE);
+		h->user = 0;
+	}
+	cpuArenasDetach(h);
+	shmHeapUnmap(h);
+	h->pd = NULL;
+	h->low = h->high = 0;
+}
+
+/* Create a heap that owns its memory, and start using it.  If "name" is NULL
+ * the memory is a memfd, which child processes inherit.  Otherwise it's a
+ * POSIX shared memory object (which must not already exist) that other
+ * processes can open with shmHeapAttachName().  The heap starts out with
+ * "initial" bytes and grows as needed, up to "max" bytes.  Returns 0 on
+ * success or -1 on failure.  shm_unlink() the name when you're done with it.
+ */
+int shmHeapCreate(const char *name, size_t initial, size_t max)
+{
+	return shmHeapCreateWithOptions(name, initial, max, NULL);
+}
+
+/* The same as shmHeapCreate(), but with settings.  "opts" can be NULL.  With
+ * SHM_HEAP_HUGE_TLB, an unnamed heap is backed by explicit huge pages if the
+ * system has enough of them reserved.  Otherwise (and with
+ * SHM_HEAP_HUGE_ADVISE) we ask for transparent huge pages.  If those aren't
+ * available either, the heap just uses normal pages.
+ */
+int shmHeapCreateWithOptions(const char *name, size_t initial, size_t max, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	int ret = arenaCreate(defaultHeap, name, -1, initial, max, opts);
+	pthread_mutex_unlock(&arenaLock);
+
+	return ret;
+}
+
+/* This does the work for shmHeapCreateWithOptions() and shmHeapCreateArena().
+ * Whatever heap "h" was using is let go once the new one is mapped.  The
+ * caller holds "arenaLock".
+ *
+ * If "file" isn't -1, the heap goes in that (empty) file instead, and "name"
+ * is ignored.  On success "h" owns the descriptor.  On failure it's left open.
+ *
+ * A heap that's split into CPU Arenas divides "initial" and "max" between its
+ * parts.  Its object is made full size right away (it doesn't use any memory
+ * until it's touched), so each part can grow without resizing it.
+ */
+static int arenaCreate(ShmHeap *h, const char *name, int file, size_t initial, size_t max,
+                       const ShmHeapOptions *opts)
+{
+	unsigned int hugePages = (opts) ? opts->hugePages : SHM_HEAP_HUGE_NONE;
+	size_t page = (hugePages != SHM_HEAP_HUGE_NONE) ? SHM_HEAP_HUGE_PAGE : (size_t) getpagesize();
+	unsigned int count = (opts) ? opts->cpuArenas : 0;
+	void *heap = MAP_FAILED;
+	int fd = file;
+
+	if(file >= 0) {
+		name = NULL;
+	}
+
+	initial = (initial + page - 1) & ~(page - 1);
+	max = (max + page - 1) & ~(page - 1);
+	if(max < initial) {
+		max = initial;
+	}
+
+	size_t stride = 0;
+	if(count > 1) {
+		stride = (max / count) & ~(page - 1);
+		initial = (initial / count + page - 1) & ~(page - 1);
+		if(initial > stride) {
+			initial = stride;
+		}
+		max = stride * count;
+	}
+	size_t fileSize = (count > 1) ? max : initial;
+	if(initial < sizeof(privateData) + 2 * sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE) {
+		fprintf(stderr, "%s(): ERROR: %zu bytes is too small for a heap.\n", __func__, initial);
+		return -1;
+	}
+
+	/* The whole range is reserved when it's mapped, so if there aren't
+	 * enough huge pages, this fails right here instead of later on. */
+	if(hugePages == SHM_HEAP_HUGE_TLB && name == NULL && file < 0) {
+		fd = memfd_create("shmHeap", MFD_HUGETLB);
+		if(fd >= 0 && (ftruncate(fd, fileSize) != 0 ||
+		               (heap = shmHeapMap(fd, max, page)) == MAP_FAILED)) {
+			close(fd);
+			fd = -1;
+		}
+		if(fd < 0) {
+			fprintf(stderr, "%s(): WARNING: Huge pages aren't available.  Trying transparent huge pages.\n",
+			        __func__);
+		}
+	}
+
+	/* Unless we got huge pages above, "fd" is still the caller's file (or
+	 * -1). */
+	if(fd == file) {
+		if(name) {
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+		else if(file < 0) {
+			fd = memfd_create("shmHeap", 0);
+		}
+		if(fd < 0) {
+			fprintf(stderr, "%s(): ERROR: Unable to create the heap: %s.\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		if(ftruncate(fd, fileSize) == 0) {
+			heap = shmHeapMap(fd, max, page);
+		}
+		if(heap == MAP_FAILED) {
+			fprintf(stderr, "%s(): ERROR: Unable to map the heap: %s.\n", __func__, strerror(errno));
+			if(fd != file) {
+				close(fd);
+			}
+			if(name) {
+				shm_unlink(name);
+			}
+			return -1;
+		}
+	}
+	else {
+		/* It's already made of huge pages; there's nothing to ask for. */
+		hugePages = SHM_HEAP_HUGE_NONE;
+	}
+
+	arenaDetach(h);
+
+	ShmHeapOptions heapOpts;
+	memset(&heapOpts, 0, sizeof(heapOpts));
+	if(opts) {
+		heapOpts = *opts;
+	}
+	heapOpts.hugePages = SHM_HEAP_HUGE_NONE;
+	if(count > 1) {
+		cpuArenasInit(h, heap, stride, initial, 1, &heapOpts);
+	}
+	else {
+		heapOpts.cpuArenas = 0;
+		arenaInit(h, heap, initial, &heapOpts);
+	}
+	if(h->pd == NULL) {
+		munmap(heap, max);
+		if(fd != file) {
+			close(fd);
+		}
+		if(name) {
+			shm_unlink(name);
+		}
+		return -1;
+	}
+
+	if(count <= 1) {
+		h->pd->heapSize = initial;
+		h->pd->maxSize = max;
+	}
+
+	/* Ask for transparent huge pages over the whole range, including the
+	 * part that isn't there yet. */
+	int huge = (page == SHM_HEAP_HUGE_PAGE);
+	if(hugePages != SHM_HEAP_HUGE_NONE) {
+		huge = (shmHeapAdviseHuge(heap, max) == 0);
+		if(!huge) {
+			fprintf(stderr, "%s(): WARNING: Huge pages aren't available (%s).  Using normal pages.\n",
+			        __func__, strerror(errno));
+		}
+	}
+	if(huge) {
+		int i;
+		for(i = 0; i < arenaParts(h); i++) {
+			shmHeapSetHugePages(arenaPart(h, i)->pd);
+		}
+	}
+
+	h->high = h->low + max;
+	h->mapSize = max;
+	h->mapFd = fd;
+
+	return 0;
+}
+
+/* Start using a heap that some other process made with shmHeapCreate().
+ * Returns 0 on success or -1 on failure.
+ */
+int shmHeapAttachName(const char *name)
+{
+	pthread_mutex_lock(&arenaLock);
+	int ret = arenaAttachName(defaultHeap, name);
+	pthread_mutex_unlock(&arenaLock);
+
+	return ret;
+}
+
+/* This does the work for shmHeapAttachName() and shmHeapAttachArena().  The
+ * caller holds "arenaLock". */
+static int arenaAttachName(ShmHeap *h, const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0) {
+		fprintf(stderr, "%s(): ERROR: Unable to open %s: %s.\n", __func__, name, strerror(errno));
+		return -1;
+	}
+
+	if(arenaAttachFd(h, fd, name) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start using the heap in "fd" (which "name" describes) as "h".  On success
+ * "h" owns the descriptor.  On failure it's left open.  The caller holds
+ * "arenaLock".  Returns 0 on success or -1 on failure. */
+static int arenaAttachFd(ShmHeap *h, int fd, const char *name)
+{
+	struct stat st;
+
+	/* Look at the header to find out how much to map. */
+	privateData *pd = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(privateData)) {
+		pd = shmHeapMap(fd, sizeof(privateData), 0);
+	}
+	const char *err = (pd == MAP_FAILED) ? "No heap" : shmHeapCheckHeader(pd);
+	if(err == NULL && pd->maxSize == 0) {
+		err = "No heap";
+	}
+	if(err) {
+		fprintf(stderr, "%s(): ERROR: %s in %s.\n", __func__, err, name);
+		if(pd != MAP_FAILED) {
+			munmap(pd, sizeof(privateData));
+		}
+		return -1;
+	}
+	size_t max = (pd->cpuArenas > 1) ? pd->cpuArenas * pd->cpuArenaStride : pd->maxSize;
+	size_t hugePageSize = pd->hugePageSize;
+	munmap(pd, sizeof(privateData));
+
+	void *heap = shmHeapMap(fd, max, hugePageSize);
+	if(heap == MAP_FAILED) {
+		fprintf(stderr, "%s(): ERROR: Unable to map %s: %s.\n", __func__, name, strerror(errno));
+		return -1;
+	}
+
+	arenaDetach(h);
+	if(((privateData *) heap)->cpuArenas > 1) {
+		if(cpuArenasAttach(h, heap) != 0) {
+			munmap(heap, max);
+			return -1;
+		}
+	}
+	else {
+		h->pd = heap;
+		h->low = (uintptr_t) heap;
+		h->high = (uintptr_t) heap + max;
+		h->slot = -1;
+	}
+
+	/* Huge page advice belongs to the mapping, so every process that maps
+	 * the heap has to ask for itself. */
+	if(hugePageSize) {
+		shmHeapAdviseHuge(heap, max);
+	}
+
+	h->mapSize = max;
+	h->mapFd = fd;
+
+	return 0;
+}
+
+/* Open the heap in the file at "path", and start using it.  If the file
+ * doesn't exist or is empty, a new heap is made in it that starts out with
+ * "initial" bytes and grows as needed, up to "max" bytes.  Otherwise the heap
+ * that's already there is used, with everything that was left in it.  See
+ * shmHeapGetRoot() for finding that again.  Any number of processes can have
+ * the same file open at once.  Returns 0 on success or -1 on failure.
+ */
+int shmHeapOpen(const char *path, size_t initial, size_t max)
+{
+	return shmHeapOpenWithOptions(path, initial, max, NULL);
+}
+
+/* The same as shmHeapOpen(), but with settings.  "opts" can be NULL.  The
+ * settings are only used when a new heap is made; a heap that's already in
+ * the file keeps the ones it was made with.
+ */
+int shmHeapOpenWithOptions(const char *path, size_t initial, size_t max, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	int ret = arenaOpen(defaultHeap, path, initial, max, opts);
+	pthread_mutex_unlock(&arenaLock);
+
+	return ret;
+}
+
+/* This does the work for shmHeapOpenWithOptions() and shmHeapOpenArena().
+ * The caller holds "arenaLock". */
+static int arenaOpen(ShmHeap *h, const char *path, size_t initial, size_t max, const ShmHeapOptions *opts)
+{
+	struct stat st;
+	int ret = -1;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		fprintf(stderr, "%s(): ERROR: Unable to open %s: %s.\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	/* One process at a time gets to open the file.  If nobody else is
+	 * using it, we're the first one since it was last closed. */
+	if(heapFileLock(fd, SHM_HEAP_FILE_OPENING, F_WRLCK, 1) != 0) {
+		fprintf(stderr, "%s(): ERROR: Unable to lock %s: %s.\n", __func__, path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	int alone = (heapFileLock(fd, SHM_HEAP_FILE_USERS, F_WRLCK, 0) == 0);
+
+	if(fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s(): ERROR: Unable to stat %s: %s.\n", __func__, path, strerror(errno));
+	}
+	else if(st.st_size == 0) {
+		if(!alone) {
+			fprintf(stderr, "%s(): ERROR: %s is empty, but it's in use.\n", __func__, path);
+		}
+		else {
+			ret = arenaCreate(h, NULL, fd, initial, max, opts);
+		}
+	}
+	else if(arenaAttachFd(h, fd, path) == 0) {
+		ret = 0;
+		if(alone && heapReopen(h, path) != 0) {
+			arenaDetach(h);
+			return -1;
+		}
+	}
+
+	if(ret == 0) {
+		/* We're a user now.  This can't fail while we hold the other
+		 * lock, since nobody can be asking for a write lock. */
+		__atomic_fetch_add(&h->pd->users, 1, __ATOMIC_RELAXED);
+		h->user = 1;
+		heapFileLock(fd, SHM_HEAP_FILE_USERS, F_RDLCK, 1);
+		heapFileLock(fd, SHM_HEAP_FILE_OPENING, F_UNLCK, 0);
+	}
+	else {
+		close(fd);
+	}
+
+	return ret;
+}
+
+/* Find an unused entry in "arenas" for a new arena.  Returns NULL if they're
+ * all in use.  The caller holds "arenaLock". */
+static ShmHeap *arenaNew(void)
+{
+	int i;
+
+	for(i = 1; i < SHM_HEAP_MAX_ARENAS; i++) {
+		ShmHeap *h = &arenas[i];
+		if(h->pd == NULL) {
+			memset(h, 0, sizeof(*h));
+			h->slot = -1;
+			h->mapFd = -1;
+			if(i >= arenaCount) {
+				__atomic_store_n(&arenaCount, i + 1, __ATOMIC_RELEASE);
+			}
+			return h;
+		}
+	}
+
+	fprintf(stderr, "%s(): ERROR: This process already has %d heaps.\n", __func__, SHM_HEAP_MAX_ARENAS);
+	return NULL;
+}
+
+/* Create an arena: a heap of its own, with its own lock, that doesn't share
+ * anything with the default heap or with any other arena.  The arguments are
+ * the same as for shmHeapCreateWithOptions().  Allocate from it with
+ * shmHeapMallocFrom() and friends.  shmHeapFree() and shmHeapRealloc() work
+ * out for themselves which heap a chunk came from.  Returns NULL on failure.
+ */
+ShmHeap *shmHeapCreateArena(const char *name, size_t initial, size_t max, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	ShmHeap *h = arenaNew();
+	if(h && arenaCreate(h, name, -1, initial, max, opts) != 0) {
+		h = NULL;
+	}
+	pthread_mutex_unlock(&arenaLock);
+
+	return h;
+}
+
+/* Make an arena out of "size" bytes at "heap", the way shmHeapInitWithOptions()
+ * makes the default heap.  Processes forked afterwards can use it too.
+ * Returns NULL on failure.
+ */
+ShmHeap *shmHeapInitArena(unsigned char *heap, size_t size, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	ShmHeap *h = arenaNew();
+	if(h) {
+		arenaInit(h, heap, size, opts);
+		if(h->pd == NULL) {
+			h = NULL;
+		}
+	}
+	pthread_mutex_unlock(&arenaLock);
+
+	return h;
+}
+
+/* Start using an arena that some other process made with
+ * shmHeapCreateArena().  Returns NULL on failure.
+ */
+ShmHeap *shmHeapAttachArena(const char *name)
+{
+	pthread_mutex_lock(&arenaLock);
+	ShmHeap *h = arenaNew();
+	if(h && arenaAttachName(h, name) != 0) {
+		h = NULL;
+	}
+	pthread_mutex_unlock(&arenaLock);
+
+	return h;
+}
+
+/* Open an arena in the file at "path", the way shmHeapOpenWithOptions() opens
+ * the default heap.  Returns NULL on failure.
+ */
+ShmHeap *shmHeapOpenArena(const char *path, size_t initial, size_t max, const ShmHeapOptions *opts)
+{
+	pthread_mutex_lock(&arenaLock);
+	ShmHeap *h = arenaNew();
+	if(h && arenaOpen(h, path, initial, max, opts) != 0) {
+		h = NULL;
+	}
+	pthread_mutex_unlock(&arenaLock);
+
+	return h;
+}
+
+/* Stop using the arena "h" in this process, the way shmHeapDetach() does for
+ * the default heap.  "h" can't be used after this. */
+void shmHeapDetachArena(ShmHeap *h)
+{
+	if(h == NULL || h == defaultHeap) {
+		return;
+	}
+
+	pthread_mutex_lock(&arenaLock);
+	arenaDetach(h);
+	pthread_mutex_unlock(&arenaLock);
+}
+
+/* Get a handle for the default heap, for code that's written to take one.
+ * Returns NULL if there is no default heap. */
+ShmHeap *shmHeapDefault(void)
+{
+	return (privData) ? defaultHeap : NULL;
+}
+
+/* Remember "ptr" (something allocated from the default heap, or NULL) as the
+ * heap's root.  It's kept in the heap as an offset, so a process that maps
+ * the heap somewhere else, or opens it again with shmHeapOpen() after a
+ * restart, gets it back from shmHeapGetRoot().  Anything else that has to be
+ * found again should be linked from the root by offsets, not pointers.
+ */
+void shmHeapSetRoot(void *ptr)
+{
+	shmHeapSetRootFrom(defaultHeap, ptr);
+}
+
+void shmHeapSetRootFrom(ShmHeap *h, void *ptr)
+{
+	privateData *pd = arenaRoot(h)->pd;
+	__atomic_store_n(&pd->userRoot, (ptr) ? shmHeapOff(pd, ptr) : 0, __ATOMIC_RELEASE);
+}
+
+/* Return whatever was last given to shmHeapSetRoot(), or NULL. */
+void *shmHeapGetRoot(void)
+{
+	return shmHeapGetRootFrom(defaultHeap);
+}
+
+void *shmHeapGetRootFrom(ShmHeap *h)
+{
+	privateData *pd = arenaRoot(h)->pd;
+	ShmOffset off = __atomic_load_n(&pd->userRoot, __ATOMIC_ACQUIRE);
+	return (off) ? shmHeapPtr(pd, off) : NULL;
+}
+
+/* Pick a spot for the allocation.  On a heap with huge pages, anything that
+ * fills at least one huge page starts on a huge page boundary if possible, so
+ * it uses as few huge pages (and TLB entries) as it can.  The caller holds the
+ * lock.
+ */
+static void *_shmHeapAllocate(privateData *pd, uintptr_t base, size_t alignment, size_t size)
+{
+	if(base == 0 && pd->hugePageSize && size >= pd->hugePageSize && alignment < pd->hugePageSize) {
+		void *ptr = _shmHeapAlignedMalloc(pd, 0, pd->hugePageSize, size);
+		if(ptr) {
+			return ptr;
+		}
+	}
+
+	return _shmHeapAlignedMalloc(pd, base, alignment, size);
+}
+
+/* Allocate "size" bytes (already rounded) from "h" alone, which can be one
+ * part of a heap that's split into CPU Arenas.  Returns NULL if "h" is out of
+ * memory. */
+static void *arenaAllocate(ShmHeap *h, uintptr_t base, size_t alignment, size_t size)
+{
+	privateData *pd = h->pd;
+
+	/* Take back whatever other processes have freed for us. */
+	int slot = remoteSlotGet(h);
+	if(slot >= 0 && pd->procSlots[slot].remoteFree) {
+		remoteDrain(pd, &pd->procSlots[slot]);
+	}
+
+	void *ptr = NULL;
+	if(alignment <= SHM_HEAP_ALIGN) {
+		ptr = cacheMalloc(h, size);
+	}
+	if(ptr == NULL) {
+		shmHeapLock(pd);
+		ptr = _shmHeapAllocate(pd, base, alignment, size);
+		shmHeapUnlock(pd);
+	}
+
+	/* We're running low.  Give back whatever this thread has cached, take
+	 * back whatever is waiting on any process's queue, and try again. */
+	if(ptr == NULL) {
+		cacheFlushHeap(h);
+		remoteDrainAll(pd);
+
+		shmHeapLock(pd);
+		ptr = _shmHeapAllocate(pd, base, alignment, size);
+		if(ptr == NULL && _shmHeapGrow(h, size + alignment + sizeof(AllocStruct) + SHM_HEAP_MIN_SIZE)) {
+			ptr = _shmHeapAllocate(pd, base, alignment, size);
+		}
+		shmHeapUnlock(pd);
+	}
+
+	if(ptr) {
+		chunkFromData(ptr)->owner = slot;
+	}
+	return ptr;
+}
+
+/* This does the work for shmHeapMalloc() and shmHeapAlignedAlloc().  See
+ * _shmHeapAlignedMalloc() for "base" and "alignment".  If "h" is split into
+ * CPU Arenas, this CPU's part is tried first, and then the others. */
+static void *shmHeapAllocate(ShmHeap *h, uintptr_t base, size_t alignment, size_t size, const char *func)
+{
+	uint64_t start = traceStart(h->pd);
+	size_t request = size;
+	int parts = arenaParts(h);
+	int first = cpuArenaPick(h);
+	void *ptr = NULL;
+	int i;
+
+	/* This counts as a failed malloc, the same as running out of
+	 * memory. */
+	if(size > SHM_HEAP_MAX_SIZE ||
+	   (alignment > SHM_HEAP_ALIGN && !shmHeapAlignedFits(alignment, size))) {
+		privateData *pd = arenaPart(h, first)->pd;
+		shmHeapCount(pd->counterMalloc, 1);
+		shmHeapCount(pd->mallocFailed, 1);
+		traceEnd(h->pd, SHM_HEAP_TRACE_MALLOC, request, NULL, start);
+		fprintf(stderr, "%s(): ERROR: %zu bytes is too big.\n", func, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = shmHeapRoundSize(size);
+
+	for(i = 0; ptr == NULL && i < parts; i++) {
+		ptr = arenaAllocate(arenaPart(h, (first + i) % parts), base, alignment, size);
+	}
+
+	if(ptr == NULL) {
+		privateData *pd = arenaPart(h, first)->pd;
+		shmHeapCount(pd->counterMalloc, 1);
+		shmHeapCount(pd->mallocFailed, 1);
+		traceEnd(h->pd, SHM_HEAP_TRACE_MALLOC, request, NULL, start);
+		fprintf(stderr, "%s(): ERROR: Out of memory.\n", func);
+		return NULL;
+	}
+
+	AllocStruct *curr = chunkFromData(ptr);
+	privateData *pd = arenaPart(h, (first + i - 1) % parts)->pd;
+	shmHeapCount(pd->counterMalloc, 1);
+	traceEnd(h->pd, SHM_HEAP_TRACE_MALLOC, request, ptr, start);
+
+	/* Count what the chunk really holds, which can be a little more than
+	 * was asked for.  That's what shmHeapFree() will count. */
+	shmHeapCount(pd->mallocClasses[shmHeapStatsClass(size)], 1);
+	shmHeapCountMalloc(pd, curr->size);
+	return ptr;
+}
+
+void *shmHeapMalloc(size_t size)
+{
+	return shmHeapAllocate(defaultHeap, 0, privData->minAlign, size, __func__);
+}
+
+/* The same as shmHeapMalloc(), but from the arena "h". */
+void *shmHeapMallocFrom(ShmHeap *h, size_t size)
+{
+	return shmHeapAllocate(h, 0, h->pd->minAlign, size, __func__);
+}
+
+/* Allocate "size" bytes at an address that's a multiple of "alignment" (for
+ * example 16 for SIMD, 64 for a cache line or 4096 for a page).  "alignment"
+ * has to be a power of 2.  Free it with shmHeapFree().
+ */
+void *shmHeapAlignedAlloc(size_t alignment, size_t size)
+{
+	return shmHeapAlignedAllocFrom(defaultHeap, alignment, size);
+}
+
+/* The same as shmHeapAlignedAlloc(), but from the arena "h". */
+void *shmHeapAlignedAllocFrom(ShmHeap *h, size_t alignment, size_t size)
+{
+	if(alignment == 0 || (alignment & (alignment - 1))) {
+		fprintf(stderr, "%s(): ERROR: Alignment %zu is not a power of 2.\n", __func__, alignment);
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!shmHeapAlignedFits(alignment, 0)) {
+		fprintf(stderr, "%s(): ERROR: Alignment %zu is too big.\n", __func__, alignment);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(alignment < h->pd->minAlign) {
+		alignment = h->pd->minAlign;
+	}
+
+	return shmHeapAllocate(h, 0, alignment, size, __func__);
+}
+
+/* Free "ptr", whichever heap it came from. */
+void shmHeapFree(void *ptr)
+{
+	AllocStruct *curr;
+
+	if(ptr == NULL || (curr = shmHeapCheckChunk(ptr, __func__)) == NULL) {
+		return;
+	}
+
+	ShmHeap *h = arenaOf(ptr);
+	privateData *pd = h->pd;
+	privateData *tracePd = arenaRoot(h)->pd;
+
+	uint64_t start = traceStart(tracePd);
+	size_t size = curr->size;
+	shmHeapCount(pd->counterFree, 1);
+
+	if(remoteFree(h, curr) || cacheFree(h, curr) || quickFree(pd, curr)) {
+		shmHeapCount(pd->bytesFree, size);
+		traceEnd(tracePd, SHM_HEAP_TRACE_FREE, size, ptr, start);
+		return;
+	}
+
+	shmHeapLock(pd);
+	_shmHeapFree(pd, ptr, 1);
+	shmHeapUnlock(pd);
+	traceEnd(tracePd, SHM_HEAP_TRACE_FREE, size, ptr, start);
+}
+
+/* Allocate "n" chunks at once.  "sizes" says how big each one is, and the
+ * pointers are stored in "out".  This takes the lock once for the whole
+ * batch, and the chunks usually end up next to each other.  Returns "n", or 0
+ * (with every entry of "out" set to NULL) if there isn't enough memory for all
+ * of them.
+ */
+size_t shmHeapMallocBatch(const size_t sizes[], size_t n, void *out[])
+{
+	return shmHeapMallocBatchFrom(defaultHeap, sizes, n, out);
+}
+
+/* Allocate the whole batch from "h" alone, which can be one part of a heap
+ * that's split into CPU Arenas.  Returns 0 if "h" doesn't have room for all of
+ * it. */
+static int arenaMallocBatch(ShmHeap *h, const size_t sizes[], size_t n, void *out[])
+{
+	privateData *pd = h->pd;
+	size_t i, bytes = 0;
+
+	/* Take back whatever other processes have freed for us. */
+	int slot = remoteSlotGet(h);
+	if(slot >= 0 && pd->procSlots[slot].remoteFree) {
+		remoteDrain(pd, &pd->procSlots[slot]);
+	}
+
+	shmHeapLock(pd);
+	int success = _shmHeapMallocBatch(pd, pd->minAlign, sizes, n, out);
+	shmHeapUnlock(pd);
+
+	/* We're running low.  Give back whatever this thread has cached, take
+	 * back whatever is waiting on any process's queue, and try again. */
+	if(!success) {
+		cacheFlushHeap(h);
+		remoteDrainAll(pd);
+
+		size_t need = 0;
+		for(i = 0; i < n; i++) {
+			need += shmHeapRoundSize(sizes[i]) + sizeof(AllocStruct) + pd->minAlign;
+		}
+
+		shmHeapLock(pd);
+		success = _shmHeapMallocBatch(pd, pd->minAlign, sizes, n, out);
+		if(!success && _shmHeapGrow(h, need)) {
+			success = _shmHeapMallocBatch(pd, pd->minAlign, sizes, n, out);
+		}
+		shmHeapUnlock(pd);
+	}
+
+	if(!success) {
+		return 0;
+	}
+
+	for(i = 0; i < n; i++) {
+		AllocStruct *curr = chunkFromData(out[i]);
+		curr->owner = slot;
+		bytes += curr->size;
+		shmHeapCount(pd->mallocClasses[shmHeapStatsClass(sizes[i])], 1);
+	}
+
+	shmHeapCount(pd->counterMalloc, n);
+	shmHeapCountMalloc(pd, bytes);
+	return 1;
+}
+
+/* The same as shmHeapMallocBatch(), but from the arena "h".  If "h" is split
+ * into CPU Arenas, the whole batch comes from one part. */
+size_t shmHeapMallocBatchFrom(ShmHeap *h, const size_t sizes[], size_t n, void *out[])
+{
+	int parts = arenaParts(h);
+	int first = cpuArenaPick(h);
+	size_t total = 0;
+	size_t i;
+	int p;
+
+	if(n == 0) {
+		return 0;
+	}
+
+	/* The batch can be carved out of one chunk, so the whole thing has to
+	 * fit in one. */
+	for(i = 0; i < n; i++) {
+		out[i] = NULL;
+		if(total > SHM_HEAP_MAX_SIZE) {
+			continue;
+		}
+		if(sizes[i] > SHM_HEAP_MAX_SIZE) {
+			total = SIZE_MAX;
+		} else {
+			total += shmHeapRoundSize(sizes[i]) + sizeof(AllocStruct);
+		}
+	}
+	if(total > SHM_HEAP_MAX_SIZE) {
+		privateData *pd = arenaPart(h, first)->pd;
+		shmHeapCount(pd->counterMalloc, n);
+		shmHeapCount(pd->mallocFailed, 1);
+		fprintf(stderr, "%s(): ERROR: The batch is too big.\n", __func__);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	for(p = 0; p < parts; p++) {
+		if(arenaMallocBatch(arenaPart(h, (first + p) % parts), sizes, n, out)) {
+			return n;
+		}
+	}
+
+	privateData *pd = arenaPart(h, first)->pd;
+	shmHeapCount(pd->counterMalloc, n);
+	shmHeapCount(pd->mallocFailed, 1);
+	fprintf(stderr, "%s(): ERROR: Out of memory.\n", __func__);
+	return 0;
+}
+
+/* This does the work for shmHeapFreeBatch() for the "n" chunks (already
+ * sorted) at "ptrs" that came from "h". */
+static void freeBatch(ShmHeap *h, void *ptrs[], size_t n)
+{
+	privateData *pd = h->pd;
+	AllocStruct *run = NULL;
+	size_t i, count = 0, bytes = 0;
+
+	shmHeapLock(pd);
+	for(i = 0; i < n; i++) {
+		AllocStruct *curr;
+
+		if(ptrs[i] == NULL || (curr = shmHeapCheckChunk(ptrs[i], "shmHeapFreeBatch")) == NULL) {
+			continue;
+		}
+		size_t size = curr->size;
+
+		if(remoteFree(h, curr)) {
+			count++;
+			bytes += size;
+			continue;
+		}
+
+		/* Take the chunk before it joins a run, so a racing free (or the
+		 * same pointer twice in "ptrs") can't get it too. */
+		if(!chunkClaim(curr, 0)) {
+			fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
+			        "shmHeapFreeBatch", ptrs[i]);
+			continue;
+		}
+		count++;
+		bytes += size;
+
+		/* This one directly follows the run we're building, so just
+		 * make the run bigger. */
+		if(run && chunkNext(run) == curr) {
+			run->size += curr->size + AllocStructDataOffset;
+			memset(curr, 0, sizeof(*curr));
+			continue;
+		}
+
+		if(run) {
+			chunkRelease(pd, run);
+		}
+		run = curr;
+	}
+	if(run) {
+		chunkRelease(pd, run);
+	}
+	shmHeapUnlock(pd);
+
+	shmHeapCount(pd->counterFree, count);
+	shmHeapCount(pd->bytesFree, bytes);
+}
+
+/* Free "n" chunks at once.  NULL entries are skipped.  This takes the lock
+ * once for the whole batch (once per heap, if they came from more than one).
+ * The pointers are sorted by address first, so chunks that sit next to each
+ * other are combined before they go back into the Size Index, and each run
+ * of them is only inserted once.  Note that "ptrs" is reordered.
+ */
+void shmHeapFreeBatch(void *ptrs[], size_t n)
+{
+	size_t first, i;
+
+	qsort(ptrs, n, sizeof(ptrs[0]), shmHeapPtrCompare);
+
+	/* Each arena covers one range of addresses, so once they're sorted,
+	 * the chunks from each heap are next to each other. */
+	for(first = 0; first < n; first = i) {
+		ShmHeap *h = arenaOf(ptrs[first]);
+		for(i = first + 1; i < n && arenaOf(ptrs[i]) == h; i++) {
+		}
+		freeBatch(h, &ptrs[first], i - first);
+	}
+}
+
+/* Change the size of the allocation at "ptr", the same way realloc() does.
+ * The data stays where it is whenever possible: shrinking gives the tail back
+ * to the heap, and growing absorbs the free chunk that follows.  Only if that
+ * doesn't work do we allocate a new chunk and copy. */
+void *shmHeapRealloc(void *ptr, size_t size)
+{
+	AllocStruct *curr;
+
+	if(ptr == NULL) {
+		return shmHeapMalloc(size);
+	}
+	if(size == 0) {
+		shmHeapFree(ptr);
+		return NULL;
+	}
+	if((curr = shmHeapCheckChunk(ptr, __func__)) == NULL) {
+		return NULL;
+	}
+
+	/* The data stays in the heap it's in now. */
+	ShmHeap *h = arenaOf(ptr);
+	privateData *pd = h->pd;
 
-	/* This is a linked list of all of the chunks.  There can be more
-	 * than one chunk of free memory that is "size" bytes long.  We store
-	 * them all together. */
-	struct sizeTree *list;
-} SizeTree;
+	if(size > SHM_HEAP_MAX_SIZE) {
+		shmHeapCount(pd->counterMalloc, 1);
+		shmHeapCount(pd->mallocFailed, 1);
+		fprintf(stderr, "%s(): ERROR: %zu bytes is too big.\n", __func__, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = shmHeapRoundSize(size);
 
-static SizeTree *sizeTreeRoot = 0;
+	shmHeapLock(pd);
+	size_t oldSize = curr->size;
+	int resized = _shmHeapResize(pd, curr, size);
+	size_t newSize = curr->size;
+	shmHeapUnlock(pd);
 
-/* Traverse the tree (tree-verse (HAHA)). */
-static void sizeTreeTraverse(SizeTree *tree)
-{
-	if(tree == NULL) {
-		return;
+	if(resized) {
+		if(newSize > oldSize) {
+			shmHeapCountMalloc(pd, newSize - oldSize);
+		}
+		else {
+			shmHeapCount(pd->bytesFree, oldSize - newSize);
+		}
+		return ptr;
 	}
 
-	sizeTreeTraverse(tree->left);
-	fprintf(stderr, "size %ld: ptr ( ", tree->size);
-	SizeTree *node = tree;
-	while(node) {
-		fprintf(stderr, "%p ", node->ptr);
-		node = node->list;
+	void *newPtr = shmHeapMallocFrom(arenaRoot(h), size);
+	if(newPtr == NULL) {
+		return NULL;
 	}
-	fprintf(stderr, ")\n");
-	sizeTreeTraverse(tree->right);
+	memcpy(newPtr, ptr, (oldSize < size) ? oldSize : size);
+	shmHeapFree(ptr);
+
+	return newPtr;
 }
 
-/* Search "tree" for the predecessor to "node".  Return it in "predecessor".
- * The entry remains in the tree.*/
-static void sizeTreeFindPredecessor(SizeTree *tree, SizeTree *node, SizeTree **predecessor)
+/* Return the number of bytes that can actually be used at "ptr".  It's at
+ * least as many as were asked for. */
+size_t shmHeapMallocUsableSize(void *ptr)
 {
-	if(tree == NULL) {
-		return;
-	}
+	AllocStruct *curr;
 
-	/* If the current value is larger or equal to "node", look for something
-	 * smaller. */
-	if(tree->size >= node->size) {
-		sizeTreeFindPredecessor(tree->left, node, predecessor);
+	if(ptr == NULL || (curr = shmHeapCheckChunk(ptr, __func__)) == NULL) {
+		return 0;
 	}
 
-	/* The current value is smaller.  Save it and look down the right side
-	 * for a better match. */
-	else {
-		*predecessor = tree;
-		sizeTreeFindPredecessor(tree->right, node, predecessor);
-	}
+	return curr->size;
 }
 
-/* Locate an entry of "size" bytes (or slightly larger) from "tree".  Return it
- * in "node".  We're essentially looking for either an exact match or the
- * successor to an exact match.
+/* Give the pages of every free chunk back to the OS right away, instead of
+ * waiting for them to decay.  Anything the calling thread has cached, and
+ * anything waiting on a Remote Free Queue, is given back to the heap first.
+ * Returns the number of bytes that were purged.
  */
-static void sizeTreeFindNode(SizeTree *tree, size_t size, SizeTree **node)
+size_t shmHeapTrim(void)
 {
-	if(tree == NULL) {
-		return;
-	}
-
-	/* If the current value is too small, look for something larger. */
-	if(tree->size < size) {
-		sizeTreeFindNode(tree->right, size, node);
-	}
-
-	/* This size will work.  Save it and look down the left side for a
-	 * better match. */
-	else {
-		*node = tree;
-		sizeTreeFindNode(tree->left, size, node);
-	}
+	return shmHeapTrimFrom(defaultHeap);
 }
 
-/* Insert "node" into "tree". */
-static SizeTree *sizeTreeInsertNode(SizeTree *tree, SizeTree *node)
+/* The same as shmHeapTrim(), but for the arena "h". */
+size_t shmHeapTrimFrom(ShmHeap *h)
 {
-	if(tree == NULL) {
-		tree = node;
-	}
-	else if(tree->size == node->size) {
-		node->list = tree->list;
-		tree->list = node;
-	}
-	else if(tree->size > node->size) {
-		tree->left = sizeTreeInsertNode(tree->left, node);
-	}
-	else {
-		tree->right = sizeTreeInsertNode(tree->right, node);
+	size_t bytes = 0;
+	int i;
+
+	for(i = 0; i < arenaParts(h); i++) {
+		ShmHeap *part = arenaPart(h, i);
+		privateData *pd = part->pd;
+
+		cacheFlushHeap(part);
+		remoteDrainAll(pd);
+
+		shmHeapLock(pd);
+		quickConsolidate(pd);
+		bytes += purgeAll(pd, sizeof(SizeTree) + shmHeapPageSize(pd), UINT64_MAX);
+		shmHeapUnlock(pd);
 	}
 
-	return tree;
+	return bytes;
 }
 
-/* Locate and remove "node" from "tree". */
-static SizeTree *sizeTreeRemoveNode(SizeTree *tree, SizeTree *node, int *success)
+/* Coalesce every chunk on the heap's Quick Lists (see
+ * ShmHeapOptions.quickLimit) and put it back into the Size Index.  A heap that
+ * defers coalescing can call this from a maintenance thread, so that mallocs
+ * rarely have to.  Returns the number of bytes that were on the lists.
+ */
+size_t shmHeapConsolidate(void)
 {
-	if(tree != NULL) {
+	return shmHeapConsolidateFrom(defaultHeap);
+}
 
-		/* If "node" is at the head of the "tree"... */
-		if(tree == node) {
-			if(node->list) {
-				/* There are other nodes of the same size.  Just
-				 * promote one of them up so it's the new head
-				 * of the tree. */
-				node->list->left = node->left;
-				node->list->right = node->right;
-				tree = node->list;
-			}
-			else if(node->left == NULL) {
-				/* Left side is empty.  Promote the right side up
-				 * one level.  Note that the right side might also
-				 * be empty. */
-				tree = node->right;
-			}
-			else if(node->right == NULL) {
-				/* Right side is empty.  Promote the left side up
-				 * one level.  Note that the left side might also
-				 * be empty. */
-				tree = node->left;
-			}
-			else {
-				/* There are left and right entries.  Use the
-				 * left side as the new tree, and hook the right
-				 * side to the far-right edge of the left side. */
-				SizeTree *pred = NULL;
-				sizeTreeFindPredecessor(tree->left, node, &pred);
-				tree = node->left;
-				pred->right = node->right;
-			}
-
-			*success = 1;
-		}
-
-		 /* If our "node" is on the "list" for the size we're staring at,
-		  * just remove it from the list.  The tree doesn't change. */
-		else if(tree->size == node->size) {
-			SizeTree *n = tree;
-			while(n) {
-				if(n->list == node) {
-					n->list = node->list;
-					*success = 1;
-					break;
-				}
-				n = n->list;
-			}
-		}
+/* The same as shmHeapConsolidate(), but for the arena "h". */
+size_t shmHeapConsolidateFrom(ShmHeap *h)
+{
+	size_t bytes = 0;
+	int i;
 
-		/* If the current tree node is too big, look for something smaller. */
-		else if(tree->size > node->size) {
-			tree->left = sizeTreeRemoveNode(tree->left, node, success);
-		}
+	for(i = 0; i < arenaParts(h); i++) {
+		privateData *pd = arenaPart(h, i)->pd;
 
-		/* If the current tree node is too small, look for something larger. */
-		else {
-			tree->right = sizeTreeRemoveNode(tree->right, node, success);
+		if(__atomic_load_n(&pd->quickBytes, __ATOMIC_RELAXED) == 0) {
+			continue;
 		}
+		shmHeapLock(pd);
+		bytes += quickConsolidate(pd);
+		shmHeapUnlock(pd);
 	}
 
-	return tree;
+	return bytes;
 }
 
-/******************************************************************************
- ******************************************************************************
- **** This is the implementation of the Address Tree.
- ******************************************************************************
- ******************************************************************************/
-/* This is the definition of the address tree. */
-typedef struct addrTree {
-	struct addrTree *left;
-	struct addrTree *right;
-
-	/* This is a pointer to our internal data structure. */
-	struct allocStruct *ptr;
-} AddrTree;
-
-static AddrTree *addrTreeRoot = 0;
+/* Find out how much the heap lock has been fought over.  For a heap that's
+ * split into CPU Arenas, these are the totals for all of their locks. */
+void shmHeapGetLockStats(ShmHeapLockStats *stats)
+{
+	shmHeapGetLockStatsFrom(defaultHeap, stats);
+}
 
-/* Traverse the tree. */
-static void addrTreeTraverse(AddrTree *tree)
+/* The same as shmHeapGetLockStats(), but for the arena "h". */
+void shmHeapGetLockStatsFrom(ShmHeap *h, ShmHeapLockStats *stats)
 {
-	if(tree == NULL) {
-		return;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for(i = 0; i < arenaParts(h); i++) {
+		privateData *pd = arenaPart(h, i)->pd;
+		stats->acquired += __atomic_load_n(&pd->lockAcquired, __ATOMIC_RELAXED);
+		stats->contended += __atomic_load_n(&pd->lockContended, __ATOMIC_RELAXED);
+		stats->waitNs += __atomic_load_n(&pd->lockWaitNs, __ATOMIC_RELAXED);
 	}
+}
 
-	addrTreeTraverse(tree->left);
-	fprintf(stderr, "addr %p\n", tree->ptr);
-	addrTreeTraverse(tree->right);
+/* Copy up to "max" trace records that haven't been read yet into "out", oldest
+ * first, and return how many were copied.  Records that were overwritten
+ * before they could be read show up as a gap in "seq".  Only one process
+ * should read the trace at a time.  Returns 0 if the heap has no Trace Ring.
+ */
+size_t shmHeapTraceRead(ShmHeapTraceRecord *out, size_t max)
+{
+	return shmHeapTraceReadFrom(defaultHeap, out, max);
 }
 
-/* Find the largest address in the Addr Tree that is smaller than ptr.  Return
- * it in "predecessor".  Note that the entry remains in the tree. */
-static void addrTreeFindPredecessor(AddrTree *tree, AddrTree *node, AddrTree **predecessor)
+/* The same as shmHeapTraceRead(), but for the arena "h".  A heap that's split
+ * into CPU Arenas has one Trace Ring for all of its parts. */
+size_t shmHeapTraceReadFrom(ShmHeap *h, ShmHeapTraceRecord *out, size_t max)
 {
-	if(tree == NULL) {
-		return;
+	privateData *pd = arenaRoot(h)->pd;
+	size_t count = 0;
+
+	if(pd->traceRing == 0) {
+		return 0;
 	}
+	ShmHeapTraceRecord *ring = shmHeapPtr(pd, pd->traceRing);
 
-	/* If the current value is larger than or equal to "node", look for
-	 * something smaller. */
-	if(tree->ptr >= node->ptr) {
-		addrTreeFindPredecessor(tree->left, node, predecessor);
+	uint64_t tail = pd->traceTail;
+	uint64_t head = __atomic_load_n(&pd->traceHead, __ATOMIC_ACQUIRE);
+	if(head - tail > pd->traceMask + 1) {
+		tail = head - (pd->traceMask + 1);
 	}
 
-	/* The current value is smaller.  Save it and look down the right side
-	 * for a better match. */
-	else {
-		*predecessor = tree;
-		addrTreeFindPredecessor(tree->right, node, predecessor);
+	while(count < max && tail != head) {
+		ShmHeapTraceRecord *rec = &ring[tail & pd->traceMask];
+
+		/* A writer hasn't finished this one yet.  Try again later. */
+		uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if(seq == 0 || seq < tail + 1) {
+			break;
+		}
+
+		out[count] = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* Keep it only if nobody overwrote it while we were copying. */
+		if(seq == tail + 1 && __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+			out[count++].seq = tail;
+		}
+		tail++;
 	}
+
+	pd->traceTail = tail;
+	return count;
+}
+
+/* Fill in "stats" with a snapshot of the heap's statistics.  Everything is
+ * kept up to date as the heap is used, so this just copies the counters with
+ * atomic loads.  It doesn't take the lock or look at a single chunk, so it's
+ * cheap enough to call from a monitoring thread.  The counters are read one
+ * at a time, so while other threads are busy they can be a little out of
+ * step with each other. */
+void shmHeapGetStats(ShmHeapStats *stats)
+{
+	shmHeapGetStatsFrom(defaultHeap, stats);
 }
 
-static AddrTree *addrTreeInsertNode(AddrTree *tree, AddrTree *node)
+/* The same as shmHeapGetStats(), but for the arena "h".  For a heap that's
+ * split into CPU Arenas, this adds up all of the parts.  "largestFree" is the
+ * biggest chunk in any part, and "peakInUseBytes" is the sum of each part's
+ * peak. */
+void shmHeapGetStatsFrom(ShmHeap *h, ShmHeapStats *stats)
 {
-	if(tree == NULL) {
-		tree = node;
+	int i, p;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for(p = 0; p < arenaParts(h); p++) {
+		privateData *pd = arenaPart(h, p)->pd;
+
+		stats->freeBytes += __atomic_load_n(&pd->freeChunkBytes, __ATOMIC_RELAXED);
+		stats->freeChunks += __atomic_load_n(&pd->freeChunks, __ATOMIC_RELAXED);
+		uint64_t largest = __atomic_load_n(&pd->largestFree, __ATOMIC_RELAXED);
+		if(largest > stats->largestFree) {
+			stats->largestFree = largest;
+		}
+		stats->purgedBytes += __atomic_load_n(&pd->bytesPurged, __ATOMIC_RELAXED);
+		for(i = 0; i < SHM_HEAP_STATS_CLASSES; i++) {
+			stats->freeClasses[i] += __atomic_load_n(&pd->freeClasses[i], __ATOMIC_RELAXED);
+		}
+
+		stats->mallocCount += __atomic_load_n(&pd->counterMalloc, __ATOMIC_RELAXED);
+		stats->freeCount += __atomic_load_n(&pd->counterFree, __ATOMIC_RELAXED);
+		stats->failedCount += __atomic_load_n(&pd->mallocFailed, __ATOMIC_RELAXED);
+		stats->inUseBytes += __atomic_load_n(&pd->bytesMalloc, __ATOMIC_RELAXED) -
+		                     __atomic_load_n(&pd->bytesFree, __ATOMIC_RELAXED);
+		stats->peakInUseBytes += __atomic_load_n(&pd->peakInUse, __ATOMIC_RELAXED);
+		for(i = 0; i < SHM_HEAP_STATS_CLASSES; i++) {
+			stats->mallocClasses[i] += __atomic_load_n(&pd->mallocClasses[i], __ATOMIC_RELAXED);
+		}
+
+		stats->lock.acquired += __atomic_load_n(&pd->lockAcquired, __ATOMIC_RELAXED);
+		stats->lock.contended += __atomic_load_n(&pd->lockContended, __ATOMIC_RELAXED);
+		stats->lock.waitNs += __atomic_load_n(&pd->lockWaitNs, __ATOMIC_RELAXED);
 	}
-	else if(tree->ptr > node->ptr) {
-		tree->left = addrTreeInsertNode(tree->left, node);
+
+	if(stats->freeBytes > stats->largestFree) {
+		stats->fragmentation = 1.0 - (double) stats->largestFree / (double) stats->freeBytes;
 	}
-	else {
-		tree->right = addrTreeInsertNode(tree->right, node);
+}
+
+/* Set the most chunks of any one size that a thread may keep in its cache.
+ * 0 turns the cache off.  This only affects the calling process. */
+void shmHeapSetCacheLimit(unsigned int limit)
+{
+	cacheLimit = limit;
+	if(limit == 0) {
+		cacheFlushAll(threadCache);
 	}
+}
 
-	return tree;
+/* Hand everything in the calling thread's caches back to their heaps. */
+void shmHeapCacheFlush(void)
+{
+	cacheFlushAll(threadCache);
 }
 
-static AddrTree *addrTreeRemove(AddrTree *tree, AddrTree *node, int *status)
+void shmHeapDisp(void)
 {
-	if(tree == NULL) {
-		return NULL;
-	}
-	else if(tree->ptr > node->ptr) {
-		tree->left = addrTreeRemove(tree->left, node, status);
-	}
-	else if(tree->ptr < node->ptr) {
-		tree->right = addrTreeRemove(tree->right, node, status);
-	}
-	else {
-		/* We found our entry. */
-		*status = 1;
+	shmHeapDispFrom(defaultHeap);
+}
 
-		if(tree->right == NULL) {
-			tree = tree->left;
-		}
-		else if(tree->left == NULL) {
-			tree = tree->right;
-		}
-		else {
-			/* There are left and right entries.  Use the left side
-			 * as the new tree, and hook the right side to the
-			 * far-right edge of the left side. */
-			AddrTree *pred = NULL;
-			addrTreeFindPredecessor(tree->left, node, &pred);
-			tree = node->left;
-			pred->right = node->right;
+/* The same as shmHeapDisp(), but for the arena "h". */
+void shmHeapDispFrom(ShmHeap *h)
+{
+	ShmHeapStats stats;
+	shmHeapGetStatsFrom(h, &stats);
+	fprintf(stderr, "%s(): inUse %" PRIu64 " (peak %" PRIu64 "): free %" PRIu64 " in %" PRIu64
+	        " chunks: largest %" PRIu64 ": fragmentation %.3f: failed %" PRIu64 ".\n",
+	        __func__, stats.inUseBytes, stats.peakInUseBytes, stats.freeBytes, stats.freeChunks,
+	        stats.largestFree, stats.fragmentation, stats.failedCount);
+
+	int i;
+	for(i = 0; i < arenaParts(h); i++) {
+		privateData *pd = arenaPart(h, i)->pd;
+		if(arenaParts(h) > 1) {
+			fprintf(stderr, "%s(): CPU Arena %d:\n", __func__, i);
 		}
-	}
 
-	return tree;
+		shmHeapLock(pd);
+
+		fprintf(stderr, "%s(): counterMalloc %" PRIu64 ": bytesMalloc %" PRIu64 ").\n",
+		        __func__, pd->counterMalloc, pd->bytesMalloc);
+		fprintf(stderr, "%s(): counterFree %" PRIu64 ": bytesFree %" PRIu64 ").\n",
+		        __func__, pd->counterFree, pd->bytesFree);
+		fprintf(stderr, "%s(): bytesPurged %" PRIu64 ".\n", __func__, pd->bytesPurged);
+		fprintf(stderr, "%s(): lockAcquired %" PRIu64 ": lockContended %" PRIu64 ": lockWaitNs %" PRIu64 ".\n",
+		        __func__, pd->lockAcquired, pd->lockContended, pd->lockWaitNs);
+
+		fprintf(stderr, "These are the Size Bins:\n");
+		binTraverse(pd);
+		fprintf(stderr, "\n");
+
+		fprintf(stderr, "This is the Size Tree:\n");
+		sizeTreeTraverse(pd, shmHeapPtr(pd, pd->sizeTreeRoot));
+		fprintf(stderr, "\n");
+
+		shmHeapUnlock(pd);
+	}
 }
 
 /******************************************************************************
  ******************************************************************************
- **** This is the public API.
+ **** This is the implementation of the Object Pools.
  ******************************************************************************
  ******************************************************************************/
+/* A pool hands out objects that are all the same size.  The objects live in
+ * slabs, and each slab is one ordinary chunk from the heap.  An object has no
+ * header of its own.  Instead, every slab is allocated at an offset (from the
+ * privateData header) that's a multiple of the slab size, so the slab an
+ * object belongs to is found by masking off the low bits of its offset.
+ * Masking the offset instead of the address means this works no matter where
+ * each process has the heap mapped.
+ *
+ * A new slab hands its objects out in order, by bumping "bumped".  Objects
+ * that are freed go onto the slab's free list, which is linked through the
+ * first word of each object.  Each slab also has a bitmap with a bit for every
+ * object that's handed out, so a free of an object that isn't is caught.  Slabs that have at least one free object are
+ * kept on the pool's "partial" list.  When a slab becomes empty it goes back
+ * to the heap, unless it's the only slab the pool has left to allocate from.
+ *
+ * The pool and its slabs live in the heap, so any process can use a pool.
+ * Each pool has its own lock.  It's always taken before the heap lock.  A
+ * pool's slabs come from the heap the pool itself is in, and offsets are
+ * taken from that heap's header (the first part, if it's split into CPU
+ * Arenas).
+ */
+#define SHM_HEAP_POOL_MAGIC          0x5EAB0001
+#define SHM_HEAP_POOL_DEFAULT_OBJS   64
 
-/* There is exactly one of these data structures.  It's used to store private
- * data. */
-typedef struct privateData {
-	uint64_t counterFree;
-	uint64_t bytesFree;
-	uint64_t counterMalloc;
-	uint64_t bytesMalloc;
-} privateData;
-static privateData *privData = NULL;
+/* This is the header at the start of each slab. */
+typedef struct shmHeapSlab {
+	uint32_t magic;
 
-/* This is the data structure that is used for each chunk of allocated mem. */
-typedef struct allocStruct {
+	/* How many objects are handed out, and how many have ever been handed
+	 * out.  Objects past "bumped" have never been used. */
+	uint32_t inUse;
+	uint32_t bumped;
+
+	/* The pool this slab belongs to. */
+	ShmOffset pool;
+
+	/* The free objects that are below "bumped". */
+	ShmOffset freeList;
+
+	/* The pool's "partial" list.  "prev" is 0 for the head. */
+	ShmOffset next;
+	ShmOffset prev;
+
+	/* One bit for each object, set while it's handed out. */
+	uint8_t inUseMap[];
+} ShmHeapSlab;
+
+struct shmHeapPool {
 	uint32_t magic;
-	size_t size;
-	int allocated;
+	pthread_mutex_t lock;
 
-	/* This is how we store it in the Size Tree. */
-	SizeTree sizeTreeNode;
+	size_t objSize;
+	uint32_t objsPerSlab;
 
-	/* This is how we store it in the Address Tree. */
-	AddrTree addrTreeNode;
+	/* Slabs are this big, and aligned to it.  It's a power of 2. */
+	size_t slabSize;
 
-	/* The actual data. */
-	unsigned char data[0];
-} AllocStruct;
-static size_t AllocStructDataOffset = (size_t) (&((AllocStruct *)0)->data);
+	/* Where the first object sits in each slab, after the header and its
+	 * bitmap. */
+	size_t objOffset;
 
-static void *_shmHeapMalloc(size_t size)
+	/* The slabs that have free objects. */
+	ShmOffset partial;
+};
+
+static void poolSlabLink(privateData *pd, ShmHeapPool *pool, ShmHeapSlab *slab)
 {
-	SizeTree *sizeTreeNode = 0;
-	sizeTreeFindNode(sizeTreeRoot, size + sizeof(AllocStruct), &sizeTreeNode);
-	if(sizeTreeNode == 0) 	{
-		fprintf(stderr, "%s(): ERROR: Out of memory.\n", __func__);
-		return (void *) NULL;
+	slab->prev = 0;
+	slab->next = pool->partial;
+	if(pool->partial) {
+		((ShmHeapSlab *) shmHeapPtr(pd, pool->partial))->prev = shmHeapOff(pd, slab);
 	}
+	pool->partial = shmHeapOff(pd, slab);
+}
 
-	int success = 0;
-	sizeTreeRoot = sizeTreeRemoveNode(sizeTreeRoot, sizeTreeNode, &success);
-	if(success == 0) {
-		fprintf(stderr, "%s(): ERROR: Didn't find matching size node\n", __func__);
+static void poolSlabUnlink(privateData *pd, ShmHeapPool *pool, ShmHeapSlab *slab)
+{
+	if(slab->prev) {
+		((ShmHeapSlab *) shmHeapPtr(pd, slab->prev))->next = slab->next;
 	}
-
-	AllocStruct *curr = sizeTreeNode->ptr;
-	if(curr->magic != SHM_HEAP_MAGIC) {
-		fprintf(stderr, "%s(): ERROR: Invalid header.\n", __func__);
+	else {
+		pool->partial = slab->next;
 	}
-
-	success = 0;
-	addrTreeRoot = addrTreeRemove(addrTreeRoot, &curr->addrTreeNode, &success);
-	if(success == 0) {
-		fprintf(stderr, "%s(): ERROR: Didn't find matching addr node\n", __func__);
+	if(slab->next) {
+		((ShmHeapSlab *) shmHeapPtr(pd, slab->next))->prev = slab->prev;
 	}
+	slab->next = slab->prev = 0;
+}
 
-	privData->bytesMalloc += size;
-
-	/* Calculate the total number of bytes required to service this alloc
-	 * request, and calculate the number of left over bytes in this chunk
-	 * of memory. */
-	size_t currFullSize = sizeof(AllocStruct) + size;
-	long extraBytes = curr->size - size;
-
-	memset(curr, 0, sizeof(*curr));
-	curr->magic = SHM_HEAP_MAGIC;
-	curr->size = size;
-	curr->allocated = 1;
-
-	curr->addrTreeNode.left = curr->addrTreeNode.right = NULL;
-	curr->addrTreeNode.ptr = curr;
+/* Where the first object goes in a slab of "objs" objects. */
+static size_t poolObjOffset(size_t objs, size_t align)
+{
+	size_t size = sizeof(ShmHeapSlab) + (objs + 7) / 8;
+	return (size + align - 1) & ~(align - 1);
+}
 
-	curr->sizeTreeNode.left = curr->sizeTreeNode.right = NULL;
-	curr->sizeTreeNode.size = size;
-	curr->sizeTreeNode.ptr = curr;
+/* The heap that "pool" lives in. */
+static ShmHeap *poolHeap(ShmHeapPool *pool)
+{
+	return arenaRoot(arenaOf(pool));
+}
 
-	/* Can we split this chunk?  There has to be enough extra space to create
-	 * a new AllocStruct header.  If there is enough space, we'll split it
-	 * and create a new chunk. */
-	if(extraBytes > 0) {
-		AllocStruct *extra = (AllocStruct *) ((unsigned char *) curr + currFullSize);
-		memset(extra, 0, sizeof(*extra));
-		extra->magic = SHM_HEAP_MAGIC;
-		extra->size = extraBytes - AllocStructDataOffset;
-		extra->allocated = 1;
-		extra->sizeTreeNode.size = extra->size;
-		extra->sizeTreeNode.ptr = extra;
-		extra->addrTreeNode.ptr = extra;
-		_shmHeapFree(extra->data, 0);
+/* Get a new, empty slab from "h" and put it on the "partial" list.  The
+ * caller holds the pool lock. */
+static ShmHeapSlab *poolSlabCreate(ShmHeap *h, ShmHeapPool *pool)
+{
+	privateData *pd = h->pd;
+	ShmHeapSlab *slab = shmHeapAllocate(h, (uintptr_t) pd, pool->slabSize, pool->slabSize, __func__);
+	if(slab == NULL) {
+		return NULL;
 	}
 
-	return curr->data;
+	memset(slab, 0, pool->objOffset);
+	slab->magic = SHM_HEAP_POOL_MAGIC;
+	slab->pool = shmHeapOff(pd, pool);
+	poolSlabLink(pd, pool, slab);
+
+	return slab;
 }
 
-/* The "external" argument lets us know whether this call is coming from an
- * external source.  If it is, then we want to add the amount of freed memory to
- * our internal counters.  If it's an internal call, then don't add to the
- * internal counters.
+/* Create a pool of objects that are "objSize" bytes long.  "objsPerSlab" is
+ * roughly how many objects to put in each slab (0 picks a default).  The slab
+ * size is rounded up to a power of 2, and any room that leaves is filled with
+ * more objects.  Returns NULL if there isn't enough memory for the pool.
  */
-static void _shmHeapFree(void *ptr, int external)
+ShmHeapPool *shmHeapPoolCreate(size_t objSize, unsigned int objsPerSlab)
 {
-	if(ptr == NULL) {
-		return;
-	}
+	return shmHeapPoolCreateFrom(defaultHeap, objSize, objsPerSlab);
+}
 
-	AllocStruct *curr;
-	curr = (AllocStruct *) ((unsigned char *) ptr - AllocStructDataOffset);
-	if(curr->magic != SHM_HEAP_MAGIC) {
-		fprintf(stderr, "%s(): ERROR: Invalid header.\n", __func__);
-		return;
-	}
+/* The same as shmHeapPoolCreate(), but the pool and its slabs come from the
+ * arena "h".  The other pool functions work out which heap a pool is in. */
+ShmHeapPool *shmHeapPoolCreateFrom(ShmHeap *h, size_t objSize, unsigned int objsPerSlab)
+{
+	size_t align = h->pd->minAlign;
 
-	if(curr->allocated != 1) {
-		fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
-		        __func__, ptr);
-		return;
+	if(objsPerSlab == 0) {
+		objsPerSlab = SHM_HEAP_POOL_DEFAULT_OBJS;
 	}
 
-	if(external) {
-		privData->bytesFree += curr->size;
+	/* Every object has to be able to hold a free list link, and has to
+	 * keep the heap's alignment. */
+	if(objSize < sizeof(ShmOffset)) {
+		objSize = sizeof(ShmOffset);
 	}
+	objSize = (objSize + align - 1) & ~(align - 1);
 
-	/* Check to see if the next memory block (a.k.a. the successor) is
-	 * currently free.  If it is, combine it with this memory block.  This
-	 * reduces fragmentation. */
-	AllocStruct *next = (AllocStruct *) ((unsigned char *) curr +
-	                    AllocStructDataOffset + curr->size);
-	if(next->magic != SHM_HEAP_MAGIC) {
-		fprintf(stderr, "%s(): ERROR: Invalid header at next.\n", __func__);
-		return;
+	size_t objOffset = poolObjOffset(objsPerSlab, align);
+	size_t slabSize = SHM_HEAP_ALIGN;
+	while(slabSize < objOffset + objSize * objsPerSlab) {
+		slabSize <<= 1;
 	}
-	if(next->allocated == 0) {
-		int success = 0;
-		sizeTreeRoot = sizeTreeRemoveNode(sizeTreeRoot, &next->sizeTreeNode, &success);
-		//fprintf(stderr, "REMOVED sizeTreeNode %p? %d\n", &next->sizeTreeNode, success);
-		if(success == 0) {
-			fprintf(stderr, "ERROR: Unable to locate sizeTreeNode.\n");
-		}
-
-		success = 0;
-		addrTreeRoot = addrTreeRemove(addrTreeRoot, &next->addrTreeNode, &success);
-		//fprintf(stderr, "REMOVED addrTreeNode %p? %d\n", &next->addrTreeNode, success);
-		if(success == 0) {
-			fprintf(stderr, "ERROR: Unable to locate addrTreeNode.\n");
-		}
 
-		curr->size += next->size + sizeof(AllocStruct);
-		memset(next, 0, sizeof(*next));
+	/* Fill up the rest of the slab, leaving room for a bigger bitmap. */
+	objsPerSlab = (slabSize - objOffset) / objSize;
+	while(poolObjOffset(objsPerSlab, align) + objSize * objsPerSlab > slabSize) {
+		objsPerSlab--;
 	}
+	objOffset = poolObjOffset(objsPerSlab, align);
 
-	/* Check to see if the previous memory block (a.k.a. the predecessor) is
-	 * currently free.  If it is, combine it with this memory block.  This
-	 * reduces fragmentation. */
-	AddrTree *pred = NULL;
-	addrTreeFindPredecessor(addrTreeRoot, &curr->addrTreeNode, &pred);
-	if(pred) {
-		/* Set prev to the predecessor.  Note that this refers to the
-		 * previous block that is unallocated.  We now need to look and
-		 * see if that block is adjacent to the block we're freeing. */
-		AllocStruct *prev = pred->ptr;
-		//fprintf(stderr, "prev->magic = %08x: prev->allocated = %d\n", prev->magic, prev->allocated);
-
-		AllocStruct *prev2 = (AllocStruct *) ((unsigned char *) prev + sizeof(AllocStruct) + prev->size);
-		//fprintf(stderr, "prev2->magic = %08x: prev2->allocated = %d\n", prev2->magic, prev2->allocated);
-
-		//fprintf(stderr, "prev2 %p : curr %p\n", prev2, curr);
-		if(prev2 == curr) {
-			int success = 0;
-			sizeTreeRoot = sizeTreeRemoveNode(sizeTreeRoot, &prev->sizeTreeNode, &success);
-			//fprintf(stderr, "REMOVED pred sizeTreeNode? %d\n", success);
-			if(success == 0) {
-				fprintf(stderr, "ERROR: Unable to locate sizeTreeNode.\n");
-			}
+	ShmHeapPool *pool = shmHeapMallocFrom(h, sizeof(*pool));
+	if(pool == NULL) {
+		return NULL;
+	}
 
-			success = 0;
-			addrTreeRoot = addrTreeRemove(addrTreeRoot, &prev->addrTreeNode, &success);
-			//fprintf(stderr, "REMOVED pred addrTreeNode? %d\n", success);
-			if(success == 0) {
-				fprintf(stderr, "ERROR: Unable to locate addrTreeNode.\n");
-			}
+	memset(pool, 0, sizeof(*pool));
+	pool->magic = SHM_HEAP_POOL_MAGIC;
+	shmHeapMutexInit(&pool->lock);
+	pool->objSize = objSize;
+	pool->objsPerSlab = objsPerSlab;
+	pool->slabSize = slabSize;
+	pool->objOffset = objOffset;
 
-			size_t prevSize = prev->size + curr->size + sizeof(AllocStruct);
-			memset(curr, 0, sizeof(*curr));
+	return pool;
+}
 
-			memset(prev, 0, sizeof(*prev));
-			prev->magic = SHM_HEAP_MAGIC;
-			prev->size = prevSize;
-			prev->sizeTreeNode.size = prev->size;
-			prev->sizeTreeNode.ptr = prev;
-			prev->addrTreeNode.ptr = prev;
+/* Get rid of "pool".  Every object in it has to have been freed already. */
+void shmHeapPoolDestroy(ShmHeapPool *pool)
+{
+	privateData *pd = poolHeap(pool)->pd;
 
-			curr = prev;
+	shmHeapMutexLock(&pool->lock);
+	while(pool->partial) {
+		ShmHeapSlab *slab = shmHeapPtr(pd, pool->partial);
+		if(slab->inUse) {
+			fprintf(stderr, "%s(): ERROR: Slab %p still has %u objects in use.\n",
+			        __func__, slab, slab->inUse);
 		}
+		poolSlabUnlink(pd, pool, slab);
+		slab->magic = 0;
+		shmHeapFree(slab);
 	}
+	pool->magic = 0;
+	shmHeapMutexUnlock(&pool->lock);
 
-	curr->allocated = 0;
+	shmHeapFree(pool);
+}
 
-	/* Place the chunk into the Size and Address Trees.  It is now
-	 * available for re-allocation. */
-	curr->addrTreeNode.ptr = curr;
-	addrTreeRoot = addrTreeInsertNode(addrTreeRoot, &curr->addrTreeNode);
+void *shmHeapPoolAlloc(ShmHeapPool *pool)
+{
+	ShmHeap *h = poolHeap(pool);
+	privateData *pd = h->pd;
+	void *obj;
 
-	curr->sizeTreeNode.size = curr->size;
-	curr->sizeTreeNode.ptr = curr;
-	sizeTreeRoot = sizeTreeInsertNode(sizeTreeRoot, &curr->sizeTreeNode);
-}
+	shmHeapMutexLock(&pool->lock);
 
-/*******************************************************************************
- * Public API starts here.
- ******************************************************************************/
+	ShmHeapSlab *slab = shmHeapPtr(pd, pool->partial);
+	if(slab == NULL && (slab = poolSlabCreate(h, pool)) == NULL) {
+		shmHeapMutexUnlock(&pool->lock);
+		return NULL;
+	}
 
-/* This function can be called more than once if you want to manage more than
- * 1 chunk of memory.
- */
-void shmHeapInit(unsigned char *heap, size_t size)
-{
-	/* Set up our private data area at the beginning of the first heap
-	 * chunk that is passed to us. */
-	if(privData == NULL) {
-		privData = (privateData *) heap;
-		memset(privData, 0, sizeof(*privData));
-		heap += sizeof(*privData);
-		size -= sizeof(*privData);
-		fprintf(stderr, "%s(): privData %p: (%" PRIu64 " %" PRIu64 ") (%" PRIu64 " %" PRIu64 ").\n",
-		        __func__, privData, privData->counterMalloc, privData->bytesMalloc,
-		        privData->counterFree, privData->bytesFree);
+	if(slab->freeList) {
+		obj = shmHeapPtr(pd, slab->freeList);
+		slab->freeList = *(ShmOffset *) obj;
+	}
+	else {
+		obj = (unsigned char *) slab + pool->objOffset + (size_t) slab->bumped * pool->objSize;
+		slab->bumped++;
 	}
+	size_t i = ((unsigned char *) obj - (unsigned char *) slab - pool->objOffset) / pool->objSize;
+	slab->inUseMap[i / 8] |= 1 << (i % 8);
 
-	unsigned char *heapEnd = heap + size;
+	if(++slab->inUse == pool->objsPerSlab) {
+		poolSlabUnlink(pd, pool, slab);
+	}
 
-	/* Create a dummy AllocStruct data structure at the end of this heap.
-	 * We use that data structure as a flag to let us know it's the end of
-	 * this heap (and we can't go past it). */
-	AllocStruct *endStruct = (AllocStruct *) (heapEnd - sizeof(AllocStruct));
-	endStruct->magic = SHM_HEAP_MAGIC;
-	endStruct->size = 0;
-	endStruct->allocated = 1;
+	shmHeapMutexUnlock(&pool->lock);
+	return obj;
+}
 
-	endStruct->addrTreeNode.ptr = endStruct;
-	addrTreeRoot = addrTreeInsertNode(addrTreeRoot, &endStruct->addrTreeNode);
+void shmHeapPoolFree(ShmHeapPool *pool, void *ptr)
+{
+	if(ptr == NULL) {
+		return;
+	}
 
-	endStruct->sizeTreeNode.size = 0;
-	endStruct->sizeTreeNode.ptr = endStruct;
-	sizeTreeRoot = sizeTreeInsertNode(sizeTreeRoot, &endStruct->sizeTreeNode);
+	privateData *pd = poolHeap(pool)->pd;
 
-	/* Adjust size to allow for endStruct. */
-	size -= sizeof(*endStruct);
+	ShmOffset off = shmHeapOff(pd, ptr);
+	ShmHeapSlab *slab = shmHeapPtr(pd, off & ~((ShmOffset) pool->slabSize - 1));
+	size_t rel = (unsigned char *) ptr - (unsigned char *) slab;
+	if(slab->magic != SHM_HEAP_POOL_MAGIC || slab->pool != shmHeapOff(pd, pool) ||
+	   rel < pool->objOffset || (rel - pool->objOffset) % pool->objSize != 0) {
+		fprintf(stderr, "%s(): ERROR: %p doesn't belong to pool %p.\n", __func__, ptr, pool);
+		return;
+	}
+	size_t i = (rel - pool->objOffset) / pool->objSize;
 
-	/* Create an AllocStruct data structure that matches the format that is
-	 * created by shmHeapMalloc().  Then pass it to _shmHeapFree().  This
-	 * way it looks like a regular call to _shmHeapFree(). */
-	AllocStruct *newStruct = (AllocStruct *) heap;
-	newStruct->magic = SHM_HEAP_MAGIC;
-	newStruct->size = size - AllocStructDataOffset;
-	newStruct->allocated = 1;
-	_shmHeapFree(newStruct->data, 0);
-}
+	shmHeapMutexLock(&pool->lock);
 
-void *shmHeapMalloc(size_t size)
-{
-	privData->counterMalloc++;
-	return _shmHeapMalloc(size);
-}
+	/* It was never handed out, or it's already been freed. */
+	if(i >= slab->bumped || !(slab->inUseMap[i / 8] & (1 << (i % 8)))) {
+		shmHeapMutexUnlock(&pool->lock);
+		fprintf(stderr, "%s(): ERROR: Memory at %p is not currently allocated.\n",
+		        __func__, ptr);
+		return;
+	}
+	slab->inUseMap[i / 8] &= ~(1 << (i % 8));
 
-void shmHeapFree(void *ptr)
-{
-	privData->counterFree++;
-	_shmHeapFree(ptr, 1);
-}
+	*(ShmOffset *) ptr = slab->freeList;
+	slab->freeList = off;
 
-void shmHeapDisp(void)
-{
-	fprintf(stderr, "%s(): counterMalloc %" PRIu64 ": bytesMalloc %" PRIu64 ").\n",
-	        __func__, privData->counterMalloc, privData->bytesMalloc);
-	fprintf(stderr, "%s(): counterFree %" PRIu64 ": bytesFree %" PRIu64 ").\n",
-	        __func__, privData->counterFree, privData->bytesFree);
+	if(slab->inUse-- == pool->objsPerSlab) {
+		poolSlabLink(pd, pool, slab);
+	}
 
-	fprintf(stderr, "This is the Size Tree:\n");
-	sizeTreeTraverse(sizeTreeRoot);
-	fprintf(stderr, "\n");
+	/* Give empty slabs back to the heap, but hang on to the last one so a
+	 * pool that goes back and forth between empty and not empty doesn't
+	 * keep allocating slabs. */
+	if(slab->inUse == 0 && (slab->prev || slab->next)) {
+		poolSlabUnlink(pd, pool, slab);
+		slab->magic = 0;
+		shmHeapFree(slab);
+	}
 
-	fprintf(stderr, "This is the Address Tree:\n");
-	addrTreeTraverse(addrTreeRoot);
-	fprintf(stderr, "\n");
+	shmHeapMutexUnlock(&pool->lock);
 }
-
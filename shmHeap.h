@@ -1,9 +1,168 @@
 #ifndef __SHM_HEAP_H__
 #define __SHM_HEAP_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Values for ShmHeapOptions.hugePages. */
+#define SHM_HEAP_HUGE_NONE    0   /* Normal pages. */
+#define SHM_HEAP_HUGE_ADVISE  1   /* Ask for transparent huge pages. */
+#define SHM_HEAP_HUGE_TLB     2   /* Use explicit huge pages if we own the memory. */
+
+/* Values for ShmHeapOptions.fitPolicy. */
+#define SHM_HEAP_FIT_GOOD     0   /* Any chunk from the next size class up. */
+#define SHM_HEAP_FIT_BEST     1   /* The smallest chunk that fits. */
+#define SHM_HEAP_FIT_FIRST    2   /* The lowest addressed chunk that fits. */
+#define SHM_HEAP_FIT_NEXT     3   /* The next chunk that fits after the last one. */
+
+/* Settings for shmHeapInitWithOptions().  Zero means "use the default". */
+typedef struct shmHeapOptions {
+	/* Every pointer shmHeapMalloc() returns will be aligned to at least
+	 * this many bytes.  It has to be a power of 2.  The default is 8. */
+	size_t minAlign;
+
+	/* Free chunks of at least "purgeThreshold" bytes give their pages back
+	 * to the OS once they've been free for "purgeDecayMs" milliseconds.
+	 * The defaults are 1MB and 1000ms.  Use (size_t) -1 to never purge. */
+	size_t purgeThreshold;
+	unsigned int purgeDecayMs;
+
+	/* One of the SHM_HEAP_HUGE_* values.  If huge pages aren't available,
+	 * the heap falls back to normal pages. */
+	unsigned int hugePages;
+
+	/* Keep a Trace Ring of this many records (rounded up to a power of 2)
+	 * inside the heap.  See shmHeapTraceRead().  The default is no ring. */
+	unsigned int traceEntries;
+
+	/* Split the heap into this many CPU Arenas, each with its own lock and
+	 * free lists.  A thread allocates from the one for the CPU it's
+	 * running on, and only uses the others when that one runs out.  At
+	 * most SHM_HEAP_MAX_CPU_ARENAS.  The default is not to split it. */
+	unsigned int cpuArenas;
+
+	/* Freed chunks of up to 2KB go onto Quick Lists without being
+	 * coalesced, until the lists hold this many bytes.  They're coalesced
+	 * in bulk when a malloc runs short, or by shmHeapConsolidate().  The
+	 * default (0) coalesces every chunk as soon as it's freed. */
+	size_t quickLimit;
+
+	/* How a free chunk is picked for a malloc: one of the SHM_HEAP_FIT_*
+	 * values.  With SHM_HEAP_FIT_GOOD and a "fitPercent", a chunk that's
+	 * no more than that many percent too big is taken right away.  First
+	 * and next fit search every free chunk that's big enough, so they
+	 * get slower as the number of free chunks grows. */
+	unsigned int fitPolicy;
+	unsigned int fitPercent;
+
+	/* A chunk is only split if the piece left over would hold at least
+	 * this many bytes.  Otherwise the whole chunk is handed out.  The
+	 * default (and the minimum) is 16. */
+	size_t minSplit;
+} ShmHeapOptions;
+
+/* The most CPU Arenas a heap can be split into. */
+#define SHM_HEAP_MAX_CPU_ARENAS 64
+
+/* See shmHeapGetLockStats(). */
+typedef struct shmHeapLockStats {
+	uint64_t acquired;   /* Times the heap lock was taken. */
+	uint64_t contended;  /* Times somebody else already had it. */
+	uint64_t waitNs;     /* Total time spent waiting for it. */
+} ShmHeapLockStats;
+
+/* The number of size classes in ShmHeapStats.  Class 0 counts sizes under 32
+ * bytes, class N counts sizes from 2^(N+4) up to 2^(N+5)-1, and the last class
+ * also counts everything bigger. */
+#define SHM_HEAP_STATS_CLASSES 24
+
+/* See shmHeapGetStats(). */
+typedef struct shmHeapStats {
+	uint64_t inUseBytes;       /* Bytes malloc'd and not yet freed. */
+	uint64_t peakInUseBytes;   /* The most "inUseBytes" has ever been. */
+	uint64_t freeBytes;        /* Bytes in free chunks (not thread caches). */
+	uint64_t freeChunks;       /* The number of free chunks. */
+	uint64_t largestFree;      /* The size of the biggest free chunk. */
+	uint64_t purgedBytes;      /* Free bytes whose pages went back to the OS. */
+	double fragmentation;      /* 1 - largestFree / freeBytes. */
+	uint64_t mallocCount;      /* Calls to the allocation functions. */
+	uint64_t freeCount;        /* Calls to the free functions. */
+	uint64_t failedCount;      /* Allocations that returned NULL. */
+	uint64_t freeClasses[SHM_HEAP_STATS_CLASSES];    /* Free chunks by size. */
+	uint64_t mallocClasses[SHM_HEAP_STATS_CLASSES];  /* Allocations by requested size. */
+	ShmHeapLockStats lock;
+} ShmHeapStats;
+
+/* Values for ShmHeapTraceRecord.op. */
+#define SHM_HEAP_TRACE_MALLOC 1
+#define SHM_HEAP_TRACE_FREE   2
+
+/* One call, as recorded in the Trace Ring.  See shmHeapTraceRead(). */
+typedef struct shmHeapTraceRecord {
+	uint64_t seq;      /* Position in the trace.  Gaps mean records were lost. */
+	uint64_t size;     /* Bytes asked for, or bytes freed. */
+	uint64_t offset;   /* Where the chunk is, from the start of the heap.  0 if a malloc failed. */
+	uint64_t cycles;   /* Time spent in the call, in TSC cycles (ns if there's no TSC). */
+	uint32_t pid;      /* The process that made the call. */
+	uint16_t depth;    /* Size Tree nodes visited. */
+	uint8_t op;        /* SHM_HEAP_TRACE_*. */
+	uint8_t pad;
+} ShmHeapTraceRecord;
+
+/* A heap.  The original API works on the default heap; the *From() functions
+ * take the heap to use.  See shmHeapCreateArena(). */
+typedef struct shmHeap ShmHeap;
+
+/* A pool of same-sized objects.  See shmHeapPoolCreate(). */
+typedef struct shmHeapPool ShmHeapPool;
+
 extern void shmHeapInit(unsigned char *heap, size_t size);
+extern void shmHeapInitWithOptions(unsigned char *heap, size_t size, const ShmHeapOptions *opts);
+extern int shmHeapCreate(const char *name, size_t initial, size_t max);
+extern int shmHeapCreateWithOptions(const char *name, size_t initial, size_t max, const ShmHeapOptions *opts);
+extern int shmHeapAttach(unsigned char *heap);
+extern int shmHeapAttachName(const char *name);
+extern int shmHeapOpen(const char *path, size_t initial, size_t max);
+extern int shmHeapOpenWithOptions(const char *path, size_t initial, size_t max, const ShmHeapOptions *opts);
+extern void shmHeapDetach(void);
+extern ShmHeap *shmHeapCreateArena(const char *name, size_t initial, size_t max, const ShmHeapOptions *opts);
+extern ShmHeap *shmHeapInitArena(unsigned char *heap, size_t size, const ShmHeapOptions *opts);
+extern ShmHeap *shmHeapAttachArena(const char *name);
+extern ShmHeap *shmHeapOpenArena(const char *path, size_t initial, size_t max, const ShmHeapOptions *opts);
+extern void shmHeapDetachArena(ShmHeap *h);
+extern ShmHeap *shmHeapDefault(void);
+extern void shmHeapSetRoot(void *ptr);
+extern void shmHeapSetRootFrom(ShmHeap *h, void *ptr);
+extern void *shmHeapGetRoot(void);
+extern void *shmHeapGetRootFrom(ShmHeap *h);
 extern void *shmHeapMalloc(size_t size);
+extern void *shmHeapMallocFrom(ShmHeap *h, size_t size);
+extern void *shmHeapAlignedAlloc(size_t alignment, size_t size);
+extern void *shmHeapAlignedAllocFrom(ShmHeap *h, size_t alignment, size_t size);
 extern void shmHeapFree(void *ptr);
+extern size_t shmHeapMallocBatch(const size_t sizes[], size_t n, void *out[]);
+extern size_t shmHeapMallocBatchFrom(ShmHeap *h, const size_t sizes[], size_t n, void *out[]);
+extern void shmHeapFreeBatch(void *ptrs[], size_t n);
+extern void *shmHeapRealloc(void *ptr, size_t size);
+extern size_t shmHeapMallocUsableSize(void *ptr);
+extern size_t shmHeapTrim(void);
+extern size_t shmHeapTrimFrom(ShmHeap *h);
+extern size_t shmHeapConsolidate(void);
+extern size_t shmHeapConsolidateFrom(ShmHeap *h);
+extern void shmHeapGetLockStats(ShmHeapLockStats *stats);
+extern void shmHeapGetLockStatsFrom(ShmHeap *h, ShmHeapLockStats *stats);
+extern void shmHeapGetStats(ShmHeapStats *stats);
+extern void shmHeapGetStatsFrom(ShmHeap *h, ShmHeapStats *stats);
+extern size_t shmHeapTraceRead(ShmHeapTraceRecord *out, size_t max);
+extern size_t shmHeapTraceReadFrom(ShmHeap *h, ShmHeapTraceRecord *out, size_t max);
+extern void shmHeapSetCacheLimit(unsigned int limit);
+extern void shmHeapCacheFlush(void);
+extern ShmHeapPool *shmHeapPoolCreate(size_t objSize, unsigned int objsPerSlab);
+extern ShmHeapPool *shmHeapPoolCreateFrom(ShmHeap *h, size_t objSize, unsigned int objsPerSlab);
+extern void shmHeapPoolDestroy(ShmHeapPool *pool);
+extern void *shmHeapPoolAlloc(ShmHeapPool *pool);
+extern void shmHeapPoolFree(ShmHeapPool *pool, void *ptr);
 extern void shmHeapDisp(void);
+extern void shmHeapDispFrom(ShmHeap *h);
 
 #endif // __SHM_HEAH_H__
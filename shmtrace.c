@@ -0,0 +1,167 @@
+/*******************************************************************************
+ * This reads the Trace Ring of a named heap (one made by shmHeapCreate() with
+ * a name and a non-zero ShmHeapOptions.traceEntries) from outside the
+ * processes that are using it.
+ *
+ * Usage: shmtrace [-f] [-s | -c] [-t minCycles] name
+ *
+ * By default it prints every record that hasn't been read yet and exits.
+ *   -f  Keep following the trace until interrupted.
+ *   -s  Print a summary per operation instead of the records.
+ *   -c  Print the records as a trace that "replay" can run.  Each chunk's
+ *       offset is its id, and each pid is a thread.
+ *   -t  Only print records that took at least this many cycles.
+ ******************************************************************************/
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shmHeap.h"
+
+#define BATCH (1024)
+
+/* Per-operation totals for -s. */
+typedef struct summary {
+	uint64_t count;
+	uint64_t cycles;
+	uint64_t maxCycles;
+	uint64_t maxDepth;
+} Summary;
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static const char *opName(int op)
+{
+	switch(op) {
+	case SHM_HEAP_TRACE_MALLOC: return "malloc";
+	case SHM_HEAP_TRACE_FREE:   return "free";
+	default:                    return "?";
+	}
+}
+
+static void printSummary(const Summary *sum, uint64_t lost)
+{
+	int op;
+
+	printf("%-8s %12s %12s %12s %8s\n", "op", "count", "avg cycles", "max cycles", "max depth");
+	for(op = SHM_HEAP_TRACE_MALLOC; op <= SHM_HEAP_TRACE_FREE; op++) {
+		const Summary *s = &sum[op];
+		printf("%-8s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %8" PRIu64 "\n", opName(op), s->count,
+		       s->count ? s->cycles / s->count : 0, s->maxCycles, s->maxDepth);
+	}
+	printf("%" PRIu64 " records lost.\n", lost);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f] [-s | -c] [-t minCycles] name\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	static ShmHeapTraceRecord recs[BATCH];
+	Summary sum[SHM_HEAP_TRACE_FREE + 1] = { { 0 } };
+	uint64_t minCycles = 0, lost = 0, expect = 0;
+	int follow = 0, summary = 0, capture = 0, started = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "fsct:")) != -1) {
+		switch(opt) {
+		case 'f': follow = 1;                                 break;
+		case 'c': capture = 1;                                break;
+		case 's': summary = 1;                                break;
+		case 't': minCycles = strtoull(optarg, NULL, 0);      break;
+		default:  usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	if(shmHeapAttachName(argv[optind]) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	if(capture) {
+		printf("# Captured from %s by shmtrace.\n", argv[optind]);
+	}
+	else if(!summary) {
+		printf("%12s %8s %-8s %12s %14s %12s %6s\n", "seq", "pid", "op", "size", "offset", "cycles", "depth");
+	}
+
+	while(!stop) {
+		size_t n = shmHeapTraceRead(recs, BATCH);
+		size_t i;
+
+		for(i = 0; i < n; i++) {
+			ShmHeapTraceRecord *rec = &recs[i];
+
+			if(started && rec->seq != expect) {
+				lost += rec->seq - expect;
+				if(capture) {
+					printf("# %" PRIu64 " records lost\n", rec->seq - expect);
+				}
+				else if(!summary) {
+					printf("... %" PRIu64 " records lost ...\n", rec->seq - expect);
+				}
+			}
+			started = 1;
+			expect = rec->seq + 1;
+
+			if(rec->op <= SHM_HEAP_TRACE_FREE) {
+				Summary *s = &sum[rec->op];
+				s->count++;
+				s->cycles += rec->cycles;
+				if(rec->cycles > s->maxCycles) {
+					s->maxCycles = rec->cycles;
+				}
+				if(rec->depth > s->maxDepth) {
+					s->maxDepth = rec->depth;
+				}
+			}
+
+			if(capture) {
+				if(rec->op == SHM_HEAP_TRACE_MALLOC && rec->offset) {
+					printf("m %" PRIu64 " %" PRIu64 " %u\n", rec->offset, rec->size, rec->pid);
+				}
+				else if(rec->op == SHM_HEAP_TRACE_FREE) {
+					printf("f %" PRIu64 " %u\n", rec->offset, rec->pid);
+				}
+			}
+			else if(!summary && rec->cycles >= minCycles) {
+				printf("%12" PRIu64 " %8u %-8s %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %6u\n",
+				       rec->seq, rec->pid, opName(rec->op), rec->size, rec->offset,
+				       rec->cycles, rec->depth);
+			}
+		}
+
+		if(n == BATCH) {
+			continue;
+		}
+		if(!follow) {
+			break;
+		}
+		fflush(stdout);
+		usleep(10 * 1000);
+	}
+
+	if(summary) {
+		printSummary(sum, lost);
+	}
+
+	return 0;
+}